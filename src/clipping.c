@@ -100,6 +100,11 @@ void clip_polygon_against_plane(polygon_t* polygon, int plane) {
 	vec3_t plane_point = frustum_planes[plane].point;
 	vec3_t plane_normal = frustum_planes[plane].normal;
 
+	// Nothing left to clip once a previous plane removed the whole polygon
+	if (polygon->num_vertices == 0) {
+		return;
+	}
+
 	// Declare a static array of inside vertices that will be part of the final polygon returned via parameter
 	vec3_t inside_vertices[MAX_NUM_POLY_VERTICES];
 	tex2_t inside_texcoords[MAX_NUM_POLY_VERTICES];
@@ -179,3 +184,33 @@ void clip_polygon(polygon_t* polygon)
 	clip_polygon_against_plane(polygon, NEAR_FRUSTUM_PLANE);
 	clip_polygon_against_plane(polygon, FAR_FRUSTUM_PLANE);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// A sphere is outside the frustum when its center lies further than its radius
+// behind any of the six planes (all plane normals point inside the frustum)
+///////////////////////////////////////////////////////////////////////////////
+bool is_sphere_outside_frustum(vec3_t center, float radius)
+{
+	for (int i = 0; i < NUM_PLANES; i++) {
+		float distance = vec3_dot(vec3_sub(center, frustum_planes[i].point), frustum_planes[i].normal);
+		if (distance < -radius) {
+			return true;
+		}
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A sphere is fully inside the frustum when its center lies further than its
+// radius in front of all the six planes
+///////////////////////////////////////////////////////////////////////////////
+bool is_sphere_inside_frustum(vec3_t center, float radius)
+{
+	for (int i = 0; i < NUM_PLANES; i++) {
+		float distance = vec3_dot(vec3_sub(center, frustum_planes[i].point), frustum_planes[i].normal);
+		if (distance < radius) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -1,6 +1,7 @@
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdbool.h>
 #include "vector.h"
 #include "triangle.h"
 
@@ -32,5 +33,7 @@ polygon_t create_polygon_from_triangle(vec3_t v0, vec3_t v1, vec3_t v2, tex2_t t
 void triangles_from_polygons(polygon_t* polygon, triangle_t triangle_arr[], int* num_triangles);
 
 void clip_polygon(polygon_t* polygon);
+bool is_sphere_outside_frustum(vec3_t center, float radius);
+bool is_sphere_inside_frustum(vec3_t center, float radius);
 
 #endif
\ No newline at end of file
@@ -1,19 +1,245 @@
 #include <stdio.h>
+#include <string.h>
 #include "display.h"
 
+// Size in pixels of the square tiles used to clear the buffers lazily
+#define TILE_SIZE 32
+
+// Color of the grid dots, baked into the background and drawn on redrawn tiles
+#define GRID_COLOR 0xFF444444
+
+///////////////////////////////////////////////////////////////////////////////
+// Display backends: the SDL backend opens a fullscreen window and presents
+// through the renderer, the offscreen backend only keeps the buffers in
+// memory (no window or display server needed). Both hand every finished
+// frame to the present callback, if one is set.
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	bool (*initialize)(void);
+	void (*destroy)(void);
+	void (*present)(void);
+} display_backend_t;
+
+static bool initialize_sdl_backend(void);
+static void destroy_sdl_backend(void);
+static void present_sdl_backend(void);
+static bool initialize_offscreen_backend(void);
+static void destroy_offscreen_backend(void);
+static void present_offscreen_backend(void);
+
+static const display_backend_t display_backends[] = {
+	[DISPLAY_SDL] = { initialize_sdl_backend, destroy_sdl_backend, present_sdl_backend },
+	[DISPLAY_OFFSCREEN] = { initialize_offscreen_backend, destroy_offscreen_backend, present_offscreen_backend }
+};
+static int display_backend = DISPLAY_SDL;
+static present_callback_t present_callback = NULL;
+
 static SDL_Window* window = NULL;
 static SDL_Renderer* renderer = NULL;
-static SDL_Texture* color_buffer_texture = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Presentation runs on its own thread, which owns the renderer and the
+// texture. Frames go through a ring of color buffers: one is drawn into while
+// the others wait to be presented or are being uploaded. With PRESENT_FIFO
+// every frame is shown and drawing waits for a free buffer; with
+// PRESENT_MAILBOX a new frame replaces the one still waiting, so drawing
+// never waits.
+//
+// In zero-copy mode every buffer of the ring is a streaming texture that the
+// present thread keeps locked while it's drawn into, so the rasterizer writes
+// straight into the texture memory (rows are color_buffer_stride pixels
+// apart). Otherwise the buffers are plain allocations uploaded to a single
+// texture with SDL_UpdateTexture.
+///////////////////////////////////////////////////////////////////////////////
+static SDL_Texture* color_buffer_textures[NUM_COLOR_BUFFERS];
+static uint32_t* color_buffers[NUM_COLOR_BUFFERS];
+static int color_buffer_strides[NUM_COLOR_BUFFERS];
+static SDL_Rect present_rects[NUM_COLOR_BUFFERS];
+static bool is_color_buffer_free[NUM_COLOR_BUFFERS];
+static int present_queue[NUM_COLOR_BUFFERS];
+static int num_present_queued = 0;
+static int draw_buffer_index = 0;
+static int present_mode = PRESENT_FIFO;
+
+static SDL_Thread* present_thread = NULL;
+static SDL_mutex* present_mutex = NULL;
+static SDL_cond* present_cond = NULL;
+static bool is_present_ready = false;
+static bool is_present_quitting = false;
+static bool is_zero_copy = true;
 
 static uint32_t* color_buffer = NULL;
+static int color_buffer_stride = 0;
 static float* z_buffer = NULL;
 static int window_width = 320;
 static int window_height = 200;
 
+// Dynamic resolution: the buffers are allocated at the window resolution and
+// frames are drawn into the top-left render_width x render_height corner,
+// which is scaled up to the whole window when presenting
+static int render_width = 320;
+static int render_height = 200;
+static int requested_width = 0;
+static int requested_height = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Lazy clears: clearing only flags every tile as pending. The first write (or
+// depth write) into a pending tile copies the clear value into it, and the
+// color tiles nobody touched are filled from the background when presenting.
+// The background holds the clear color and, once drawn, the grid.
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t* background_buffer = NULL;
+static uint32_t background_color = 0;
+static bool is_background_valid = false;
+static bool has_background_grid = false;
+
+static bool* color_tile_pending = NULL;
+static bool* depth_tile_pending = NULL;
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Dirty regions: when the color buffers keep their contents between frames,
+// only the tiles that changed since a buffer was last drawn into are redrawn.
+// Every frame records the tiles it changed, so a buffer holding the frame N
+// frames back needs the union of the last N records. Writes outside the
+// redrawn tiles are discarded, which clips the triangles crossing the region.
+///////////////////////////////////////////////////////////////////////////////
+#define DIRTY_HISTORY_SIZE (NUM_COLOR_BUFFERS + 1)
+
+static bool* dirty_tiles[DIRTY_HISTORY_SIZE];
+static bool* redraw_tiles = NULL;
+static bool is_full_redraw = true;
+static bool are_color_buffers_preserved = false;
+static int color_buffer_frames[NUM_COLOR_BUFFERS]; // frame held by every buffer, -1 when unknown
+static int frame_number = 0;
+
 static int render_method = 0;
 static int cull_method = 0;
 
-bool initialize_window(void) {
+static SDL_Texture* create_color_buffer_texture(void) {
+	// Creating a SDL texture that is used to display the color buffer
+	return SDL_CreateTexture(
+		renderer,
+		SDL_PIXELFORMAT_RGBA32,
+		SDL_TEXTUREACCESS_STREAMING,
+		window_width,
+		window_height
+	);
+}
+
+static bool lock_color_buffer_texture(int index) {
+	void* pixels = NULL;
+	int pitch = 0;
+	if (SDL_LockTexture(color_buffer_textures[index], NULL, &pixels, &pitch) != 0) {
+		return false;
+	}
+	color_buffers[index] = (uint32_t*)pixels;
+	color_buffer_strides[index] = pitch / (int)sizeof(uint32_t);
+	return true;
+}
+
+static void create_color_buffers(void) {
+	if (is_zero_copy) {
+		for (int i = 0; i < NUM_COLOR_BUFFERS && is_zero_copy; i++) {
+			color_buffer_textures[i] = create_color_buffer_texture();
+			is_zero_copy = color_buffer_textures[i] && lock_color_buffer_texture(i);
+		}
+		if (is_zero_copy) {
+			return;
+		}
+
+		// Fall back to copying if the textures can't be locked
+		fprintf(stderr, "Error locking the color buffer texture, zero-copy rendering disabled: %s\n", SDL_GetError());
+		for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+			if (color_buffer_textures[i]) {
+				SDL_DestroyTexture(color_buffer_textures[i]);
+				color_buffer_textures[i] = NULL;
+			}
+		}
+	}
+
+	// Allocate the required memory in bytes to hold the color buffers
+	color_buffer_textures[0] = create_color_buffer_texture();
+	for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+		color_buffers[i] = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
+		color_buffer_strides[i] = window_width;
+	}
+}
+
+static int present_thread_main(void* data) {
+	// Create a SDL renderer
+	renderer = SDL_CreateRenderer(window, -1, 0);
+	if (!renderer) {
+		fprintf(stderr, "Error creating SDL renderer: %s\n", SDL_GetError());
+	}
+	else {
+		create_color_buffers();
+	}
+
+	SDL_LockMutex(present_mutex);
+	is_present_ready = true;
+	SDL_CondBroadcast(present_cond);
+	SDL_UnlockMutex(present_mutex);
+
+	while (renderer) {
+		SDL_LockMutex(present_mutex);
+		while (num_present_queued == 0 && !is_present_quitting) {
+			SDL_CondWait(present_cond, present_mutex);
+		}
+		if (num_present_queued == 0) {
+			SDL_UnlockMutex(present_mutex);
+			break;
+		}
+		int index = present_queue[0];
+		num_present_queued--;
+		memmove(&present_queue[0], &present_queue[1], sizeof(int) * num_present_queued);
+		SDL_UnlockMutex(present_mutex);
+
+		SDL_Rect* rect = &present_rects[index];
+		if (present_callback) {
+			present_callback(color_buffers[index], rect->w, rect->h, color_buffer_strides[index]);
+		}
+
+		if (is_zero_copy) {
+			// The frame is already in the texture, unlocking uploads it
+			SDL_UnlockTexture(color_buffer_textures[index]);
+			SDL_RenderCopy(renderer, color_buffer_textures[index], rect, NULL);
+			SDL_RenderPresent(renderer);
+			lock_color_buffer_texture(index);
+		}
+		else {
+			SDL_UpdateTexture(
+				color_buffer_textures[0],
+				rect,
+				color_buffers[index],
+				(int)(color_buffer_strides[index] * sizeof(uint32_t))
+			);
+			SDL_RenderCopy(renderer, color_buffer_textures[0], rect, NULL);
+			SDL_RenderPresent(renderer);
+		}
+
+		SDL_LockMutex(present_mutex);
+		is_color_buffer_free[index] = true;
+		SDL_CondBroadcast(present_cond);
+		SDL_UnlockMutex(present_mutex);
+	}
+
+	for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+		if (color_buffer_textures[i]) {
+			SDL_DestroyTexture(color_buffer_textures[i]);
+			color_buffer_textures[i] = NULL;
+		}
+		if (is_zero_copy) {
+			color_buffers[i] = NULL;
+		}
+	}
+	SDL_DestroyRenderer(renderer);
+	renderer = NULL;
+	return 0;
+}
+
+static bool initialize_sdl_backend(void) {
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		fprintf(stderr, "Error initializing SDL: %s\n", SDL_GetError());
 		return false;
@@ -27,6 +253,10 @@ bool initialize_window(void) {
 
 	window_width = fullscreen_width / 3;
 	window_height = fullscreen_height / 3;
+	if (requested_width > 0 && requested_height > 0) {
+		window_width = requested_width;
+		window_height = requested_height;
+	}
 
 	// Create a SDL window
 	window = SDL_CreateWindow(
@@ -42,65 +272,389 @@ bool initialize_window(void) {
 		return false;
 	}
 
-	// Create a SDL renderer
-	renderer = SDL_CreateRenderer(window, -1, 0);
+	// The present thread creates the renderer and the color buffers, wait until it's done
+	present_mutex = SDL_CreateMutex();
+	present_cond = SDL_CreateCond();
+	present_thread = SDL_CreateThread(present_thread_main, "present", NULL);
+	if (!present_thread) {
+		fprintf(stderr, "Error creating present thread: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_LockMutex(present_mutex);
+	while (!is_present_ready) {
+		SDL_CondWait(present_cond, present_mutex);
+	}
+	SDL_UnlockMutex(present_mutex);
+
 	if (!renderer) {
-		fprintf(stderr, "Error creating SDL renderer: %s\n", SDL_GetError());
 		return false;
 	}
 
+	for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+		is_color_buffer_free[i] = true;
+	}
+	draw_buffer_index = 0;
+
+	// Locked textures come back with undefined contents, only copied buffers keep the previous frames
+	are_color_buffers_preserved = !is_zero_copy;
+	is_color_buffer_free[draw_buffer_index] = false;
+	color_buffer = color_buffers[draw_buffer_index];
+	color_buffer_stride = color_buffer_strides[draw_buffer_index];
+
 	SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN_DESKTOP);
 
-	// Allocate the required memory in bytes to hold the color buffer
+	return true;
+}
+
+static void destroy_sdl_backend(void) {
+	// Let the present thread show the queued frames and release the renderer
+	if (present_thread) {
+		SDL_LockMutex(present_mutex);
+		is_present_quitting = true;
+		SDL_CondBroadcast(present_cond);
+		SDL_UnlockMutex(present_mutex);
+		SDL_WaitThread(present_thread, NULL);
+	}
+	SDL_DestroyCond(present_cond);
+	SDL_DestroyMutex(present_mutex);
+
+	for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+		free(color_buffers[i]);
+	}
+	SDL_DestroyWindow(window);
+}
+
+static void present_sdl_backend(void) {
+	SDL_LockMutex(present_mutex);
+
+	// Queue the finished frame, a mailbox replaces the frame still waiting
+	if (present_mode == PRESENT_MAILBOX) {
+		for (int i = 0; i < num_present_queued; i++) {
+			is_color_buffer_free[present_queue[i]] = true;
+		}
+		num_present_queued = 0;
+	}
+	present_queue[num_present_queued++] = draw_buffer_index;
+	present_rects[draw_buffer_index] = (SDL_Rect){ 0, 0, render_width, render_height };
+	SDL_CondBroadcast(present_cond);
+
+	// Continue drawing into the first free buffer
+	while (true) {
+		int free_index = -1;
+		for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+			if (is_color_buffer_free[i]) {
+				free_index = i;
+				break;
+			}
+		}
+		if (free_index >= 0) {
+			draw_buffer_index = free_index;
+			break;
+		}
+		SDL_CondWait(present_cond, present_mutex);
+	}
+	is_color_buffer_free[draw_buffer_index] = false;
+	color_buffer = color_buffers[draw_buffer_index];
+	color_buffer_stride = color_buffer_strides[draw_buffer_index];
+
+	SDL_UnlockMutex(present_mutex);
+}
+
+static bool initialize_offscreen_backend(void) {
+	// Threads, timers and events still come from SDL, but no video subsystem
+	if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS) != 0) {
+		fprintf(stderr, "Error initializing SDL: %s\n", SDL_GetError());
+		return false;
+	}
+
+	window_width = requested_width > 0 ? requested_width : OFFSCREEN_DEFAULT_WIDTH;
+	window_height = requested_height > 0 ? requested_height : OFFSCREEN_DEFAULT_HEIGHT;
+
+	// A single color buffer, frames are presented in place
 	color_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
+	color_buffer_stride = window_width;
+	if (!color_buffer) {
+		fprintf(stderr, "Error allocating the offscreen color buffer.\n");
+		return false;
+	}
+	are_color_buffers_preserved = true;
+
+	return true;
+}
+
+static void destroy_offscreen_backend(void) {
+	free(color_buffer);
+	color_buffer = NULL;
+}
+
+static void present_offscreen_backend(void) {
+	if (present_callback) {
+		present_callback(color_buffer, render_width, render_height, color_buffer_stride);
+	}
+}
+
+void set_display_backend(int backend) {
+	// Only takes effect before initialize_window
+	display_backend = backend;
+}
+
+void set_display_resolution(int width, int height) {
+	// Only takes effect before initialize_window, 0 keeps the backend default
+	requested_width = width;
+	requested_height = height;
+}
+
+void set_present_callback(present_callback_t callback) {
+	// The callback reads the color buffer, so zero-copy rendering has to be off
+	// (the locked texture memory may only be written)
+	present_callback = callback;
+}
+
+bool initialize_window(void) {
+	if (!display_backends[display_backend].initialize()) {
+		return false;
+	}
+
+	render_width = window_width;
+	render_height = window_height;
+
+	// Allocate the buffers shared by every backend
 	z_buffer = (float*)malloc(sizeof(float) * window_width * window_height);
+	background_buffer = (uint32_t*)malloc(sizeof(uint32_t) * window_width * window_height);
 
-	// Creating a SDL texture that is used to display the color buffer
-	color_buffer_texture = SDL_CreateTexture(
-		renderer,
-		SDL_PIXELFORMAT_RGBA32,
-		SDL_TEXTUREACCESS_STREAMING,
-		window_width,
-		window_height
-	);
+	num_tiles_x = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+	num_tiles_y = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+	color_tile_pending = (bool*)calloc(num_tiles_x * num_tiles_y, sizeof(bool));
+	depth_tile_pending = (bool*)calloc(num_tiles_x * num_tiles_y, sizeof(bool));
+
+	for (int i = 0; i < DIRTY_HISTORY_SIZE; i++) {
+		dirty_tiles[i] = (bool*)calloc(num_tiles_x * num_tiles_y, sizeof(bool));
+	}
+	redraw_tiles = (bool*)calloc(num_tiles_x * num_tiles_y, sizeof(bool));
+	for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+		color_buffer_frames[i] = -1;
+	}
+	begin_dirty_region(true);
+	end_dirty_region();
 
 	return true;
 }
 
 void destroy_window(void) {
-	free(color_buffer);
+	display_backends[display_backend].destroy();
+
 	free(z_buffer);
-	SDL_DestroyRenderer(renderer);
-	SDL_DestroyWindow(window);
+	free(background_buffer);
+	free(color_tile_pending);
+	free(depth_tile_pending);
+	for (int i = 0; i < DIRTY_HISTORY_SIZE; i++) {
+		free(dirty_tiles[i]);
+	}
+	free(redraw_tiles);
 	SDL_Quit();
 }
 
+static int get_tile_at(int x, int y) {
+	return (y / TILE_SIZE) * num_tiles_x + (x / TILE_SIZE);
+}
+
+static void materialize_color_tile(int tile) {
+	int x0 = (tile % num_tiles_x) * TILE_SIZE;
+	int y0 = (tile / num_tiles_x) * TILE_SIZE;
+	int x1 = x0 + TILE_SIZE < render_width ? x0 + TILE_SIZE : render_width;
+	int y1 = y0 + TILE_SIZE < render_height ? y0 + TILE_SIZE : render_height;
+
+	for (int y = y0; y < y1; y++) {
+		memcpy(&color_buffer[color_buffer_stride * y + x0], &background_buffer[window_width * y + x0], sizeof(uint32_t) * (x1 - x0));
+	}
+	color_tile_pending[tile] = false;
+}
+
+static void materialize_depth_tile(int tile) {
+	int x0 = (tile % num_tiles_x) * TILE_SIZE;
+	int y0 = (tile / num_tiles_x) * TILE_SIZE;
+	int x1 = x0 + TILE_SIZE < render_width ? x0 + TILE_SIZE : render_width;
+	int y1 = y0 + TILE_SIZE < render_height ? y0 + TILE_SIZE : render_height;
+
+	for (int y = y0; y < y1; y++) {
+		for (int x = x0; x < x1; x++) {
+			z_buffer[window_width * y + x] = 1.0;
+		}
+	}
+	depth_tile_pending[tile] = false;
+}
+
 void render_color_buffer(void) {
-	SDL_UpdateTexture(
-		color_buffer_texture,
-		NULL,
-		color_buffer,
-		(int)(window_width * sizeof(uint32_t))
-	);
-	SDL_RenderCopy(renderer, color_buffer_texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
+	// Tiles that nothing was drawn into still show the background
+	int render_tiles_x = (render_width + TILE_SIZE - 1) / TILE_SIZE;
+	int render_tiles_y = (render_height + TILE_SIZE - 1) / TILE_SIZE;
+	for (int y = 0; y < render_tiles_y; y++) {
+		for (int x = 0; x < render_tiles_x; x++) {
+			if (color_tile_pending[y * num_tiles_x + x]) {
+				materialize_color_tile(y * num_tiles_x + x);
+			}
+		}
+	}
+
+	color_buffer_frames[draw_buffer_index] = frame_number;
+	display_backends[display_backend].present();
+
+	// Unless told otherwise the next frame is redrawn completely
+	frame_number++;
+	begin_dirty_region(true);
+	end_dirty_region();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start recording the tiles changed by the current frame. Call it, add the
+// changed rectangles and end the region before clearing the buffers.
+///////////////////////////////////////////////////////////////////////////////
+void begin_dirty_region(bool is_full) {
+	memset(dirty_tiles[frame_number % DIRTY_HISTORY_SIZE], is_full, sizeof(bool) * num_tiles_x * num_tiles_y);
+}
+
+void add_dirty_rect(int x0, int y0, int x1, int y1) {
+	// x1 and y1 are exclusive, the rectangle is clamped to the render area
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > render_width ? render_width : x1;
+	y1 = y1 > render_height ? render_height : y1;
+	if (x0 >= x1 || y0 >= y1) {
+		return;
+	}
+
+	bool* tiles = dirty_tiles[frame_number % DIRTY_HISTORY_SIZE];
+	for (int y = y0 / TILE_SIZE; y <= (y1 - 1) / TILE_SIZE; y++) {
+		for (int x = x0 / TILE_SIZE; x <= (x1 - 1) / TILE_SIZE; x++) {
+			tiles[y * num_tiles_x + x] = true;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Work out the tiles to redraw in the buffer about to be drawn into: the ones
+// changed since the frame it holds, or all of them if that frame is unknown or
+// older than the history.
+///////////////////////////////////////////////////////////////////////////////
+void end_dirty_region(void) {
+	int num_tiles = num_tiles_x * num_tiles_y;
+	int held_frame = color_buffer_frames[draw_buffer_index];
+
+	is_full_redraw = !are_color_buffers_preserved || held_frame < 0 || frame_number - held_frame > DIRTY_HISTORY_SIZE;
+	if (is_full_redraw) {
+		memset(redraw_tiles, true, sizeof(bool) * num_tiles);
+		return;
+	}
+
+	memset(redraw_tiles, false, sizeof(bool) * num_tiles);
+	for (int frame = held_frame + 1; frame <= frame_number; frame++) {
+		bool* tiles = dirty_tiles[frame % DIRTY_HISTORY_SIZE];
+		for (int i = 0; i < num_tiles; i++) {
+			redraw_tiles[i] |= tiles[i];
+		}
+	}
+}
+
+bool is_rect_dirty(int x0, int y0, int x1, int y1) {
+	if (is_full_redraw) {
+		return true;
+	}
+
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 > render_width ? render_width : x1;
+	y1 = y1 > render_height ? render_height : y1;
+	if (x0 >= x1 || y0 >= y1) {
+		return false;
+	}
+
+	for (int y = y0 / TILE_SIZE; y <= (y1 - 1) / TILE_SIZE; y++) {
+		for (int x = x0 / TILE_SIZE; x <= (x1 - 1) / TILE_SIZE; x++) {
+			if (redraw_tiles[y * num_tiles_x + x]) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void set_zero_copy_rendering(bool enabled) {
+	// Only takes effect before initialize_window
+	is_zero_copy = enabled;
+}
+
+bool is_zero_copy_rendering(void) {
+	return is_zero_copy;
+}
+
+void set_present_mode(int mode) {
+	present_mode = mode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Change the resolution frames are drawn at (clamped to the window size).
+// Call it before clearing the buffers for a new frame.
+///////////////////////////////////////////////////////////////////////////////
+void set_render_resolution(int width, int height) {
+	width = width < 1 ? 1 : (width > window_width ? window_width : width);
+	height = height < 1 ? 1 : (height > window_height ? window_height : height);
+
+	// The frames kept in the buffers were drawn at another scale
+	if (width != render_width || height != render_height) {
+		for (int i = 0; i < NUM_COLOR_BUFFERS; i++) {
+			color_buffer_frames[i] = -1;
+		}
+		begin_dirty_region(true);
+		end_dirty_region();
+	}
+
+	render_width = width;
+	render_height = height;
+}
+
+int get_render_width(void) {
+	return render_width;
+}
+
+int get_render_height(void) {
+	return render_height;
 }
 
 void clear_color_buffer(uint32_t color) {
-	for (int i = 0; i < window_width * window_height; i++) {
-		color_buffer[i] = color;
+	// The background only has to be rebuilt when the clear color changes
+	if (!is_background_valid || color != background_color) {
+		for (int i = 0; i < window_width * window_height; i++) {
+			background_buffer[i] = color;
+		}
+		background_color = color;
+		is_background_valid = true;
+		has_background_grid = false;
+
+		// A new background changes every tile
+		begin_dirty_region(true);
+		end_dirty_region();
+	}
+
+	// Only the tiles being redrawn are cleared, the others keep the previous frame
+	for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+		color_tile_pending[i] = redraw_tiles[i];
 	}
 }
 
 void clear_z_buffer(void) {
-	for (int i = 0; i < window_width * window_height; i++) {
-		z_buffer[i] = 1.0;
+	for (int i = 0; i < num_tiles_x * num_tiles_y; i++) {
+		depth_tile_pending[i] = redraw_tiles[i];
 	}
 }
 
 float get_zbuffer_at(int x, int y)
 {
-	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+	if (x < 0 || x >= render_width || y < 0 || y >= render_height) {
+		return 1.0;
+	}
+	// A pending tile reads as cleared without being touched
+	if (depth_tile_pending[get_tile_at(x, y)]) {
 		return 1.0;
 	}
 	return z_buffer[window_width * y + x];
@@ -108,26 +662,53 @@ float get_zbuffer_at(int x, int y)
 
 void update_zbuffer_at(int x, int y, float value)
 {
-	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+	if (x < 0 || x >= render_width || y < 0 || y >= render_height) {
 		return;
 	}
+	int tile = get_tile_at(x, y);
+	if (!redraw_tiles[tile]) {
+		return;
+	}
+	if (depth_tile_pending[tile]) {
+		materialize_depth_tile(tile);
+	}
 	z_buffer[window_width * y + x] = value;
 }
 
 void draw_grid(void) {
-	for (int y = 0; y < window_height; y += 10) {
-		for (int x = 0; x < window_width; x += 10) {
-			color_buffer[window_width * y + x] = 0xFF44444444;
+	// The grid is baked into the background once, pending tiles get it from there
+	if (is_background_valid && !has_background_grid) {
+		for (int y = 0; y < window_height; y += 10) {
+			for (int x = 0; x < window_width; x += 10) {
+				background_buffer[window_width * y + x] = GRID_COLOR;
+			}
+		}
+		has_background_grid = true;
+	}
+
+	for (int y = 0; y < render_height; y += 10) {
+		for (int x = 0; x < render_width; x += 10) {
+			int tile = get_tile_at(x, y);
+			if (redraw_tiles[tile] && !color_tile_pending[tile]) {
+				color_buffer[color_buffer_stride * y + x] = GRID_COLOR;
+			}
 		}
 	}
 }
 
 void draw_pixel(int x, int y, uint32_t color)
 {
-	if (x < 0 || x >= window_width || y < 0 || y >= window_height) {
+	if (x < 0 || x >= render_width || y < 0 || y >= render_height) {
 		return;
 	}
-	color_buffer[window_width * y + x] = color;
+	int tile = get_tile_at(x, y);
+	if (!redraw_tiles[tile]) {
+		return;
+	}
+	if (color_tile_pending[tile]) {
+		materialize_color_tile(tile);
+	}
+	color_buffer[color_buffer_stride * y + x] = color;
 }
 
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
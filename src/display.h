@@ -6,13 +6,28 @@
 #include <SDL.h>
 
 #define FPS 60
-#define FRAME_TARGET_TIME (1000 / FPS)
+#define FRAME_TARGET_TIME (1000.0 / FPS)
+
+#define NUM_COLOR_BUFFERS 3
+
+#define OFFSCREEN_DEFAULT_WIDTH 640
+#define OFFSCREEN_DEFAULT_HEIGHT 360
 
 enum cull_method {
 	CULL_NONE,
 	CULL_BACKFACE
 };
 
+enum display_backend {
+	DISPLAY_SDL,
+	DISPLAY_OFFSCREEN
+};
+
+enum present_mode {
+	PRESENT_FIFO,
+	PRESENT_MAILBOX
+};
+
 enum render_method {
 	RENDER_WIRE,
 	RENDER_WIRE_VERTEX,
@@ -22,9 +37,16 @@ enum render_method {
 	RENDER_TEXTURED_WIRE
 };
 
+// Called with every finished frame (rows are stride pixels apart)
+typedef void (*present_callback_t)(const uint32_t* pixels, int width, int height, int stride);
+
 int get_window_width(void);
 int get_window_height(void);
 
+void set_render_resolution(int width, int height);
+int get_render_width(void);
+int get_render_height(void);
+
 void set_render_method(int method);
 bool should_render_filled_triangle(void);
 bool should_render_textured_triangle(void);
@@ -34,10 +56,20 @@ bool should_render_wire_vertex(void);
 void set_cull_method(int method);
 bool is_cull_backface(void);
 
+void set_display_backend(int backend);
+void set_display_resolution(int width, int height);
 bool initialize_window(void);
 void destroy_window(void);
 
 void render_color_buffer(void);
+void begin_dirty_region(bool is_full);
+void add_dirty_rect(int x0, int y0, int x1, int y1);
+void end_dirty_region(void);
+bool is_rect_dirty(int x0, int y0, int x1, int y1);
+void set_present_mode(int mode);
+void set_present_callback(present_callback_t callback);
+void set_zero_copy_rendering(bool enabled);
+bool is_zero_copy_rendering(void);
 void clear_color_buffer(uint32_t color);
 void clear_z_buffer(void);
 
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "file_map.h"
+
+#ifdef _WIN32
+
+bool map_file(file_map_t* map, const char* filename) {
+	map->data = NULL;
+	map->size = 0;
+	map->handle = NULL;
+
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Error opening %s\n", filename);
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		fprintf(stderr, "Error reading the size of %s\n", filename);
+		CloseHandle(file);
+		return false;
+	}
+	if (size.QuadPart == 0) {
+		CloseHandle(file);
+		return true;
+	}
+
+	// The mapping keeps its own reference to the file
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (!mapping) {
+		fprintf(stderr, "Error mapping %s\n", filename);
+		return false;
+	}
+
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		fprintf(stderr, "Error mapping %s\n", filename);
+		CloseHandle(mapping);
+		return false;
+	}
+
+	map->data = (const char*)data;
+	map->size = (size_t)size.QuadPart;
+	map->handle = mapping;
+	return true;
+}
+
+void unmap_file(file_map_t* map) {
+	if (map->data) {
+		UnmapViewOfFile(map->data);
+		CloseHandle((HANDLE)map->handle);
+	}
+	map->data = NULL;
+	map->size = 0;
+	map->handle = NULL;
+}
+
+bool get_file_info(const char* filename, int64_t* mtime, uint64_t* size) {
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &info)) {
+		return false;
+	}
+	*mtime = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	*size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	return true;
+}
+
+#else
+
+bool map_file(file_map_t* map, const char* filename) {
+	map->data = NULL;
+	map->size = 0;
+	map->handle = NULL;
+
+	int file = open(filename, O_RDONLY);
+	if (file < 0) {
+		fprintf(stderr, "Error opening %s\n", filename);
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(file, &info) != 0) {
+		fprintf(stderr, "Error reading the size of %s\n", filename);
+		close(file);
+		return false;
+	}
+	if (info.st_size == 0) {
+		close(file);
+		return true;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	void* data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Error mapping %s\n", filename);
+		return false;
+	}
+
+	// The parsers read front to back
+	madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+	map->data = (const char*)data;
+	map->size = (size_t)info.st_size;
+	return true;
+}
+
+void unmap_file(file_map_t* map) {
+	if (map->data) {
+		munmap((void*)map->data, map->size);
+	}
+	map->data = NULL;
+	map->size = 0;
+	map->handle = NULL;
+}
+
+bool get_file_info(const char* filename, int64_t* mtime, uint64_t* size) {
+	struct stat info;
+	if (stat(filename, &info) != 0) {
+		return false;
+	}
+	*mtime = (int64_t)info.st_mtime;
+	*size = (uint64_t)info.st_size;
+	return true;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef FILE_MAP_H
+#define FILE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A read-only view of a whole file mapped into memory (data is NULL for an
+// empty file). The text isn't null-terminated, parsers must stop at data + size.
+typedef struct {
+	const char* data;
+	size_t size;
+	void* handle; // mapping object on Windows, unused elsewhere
+} file_map_t;
+
+bool map_file(file_map_t* map, const char* filename);
+void unmap_file(file_map_t* map);
+
+// Last modification time (in platform units) and size, false if the file doesn't exist
+bool get_file_info(const char* filename, int64_t* mtime, uint64_t* size);
+
+#endif
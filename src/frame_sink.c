@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "frame_sink.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame sink: streams the presented frames as a PPM sequence or a Y4M video
+// to a file or to stdout ("-"). Frames are copied into a small pool of
+// recycled buffers and written by a background thread. When every buffer is
+// still waiting to be written the frame is dropped (and counted) instead of
+// stalling the render loop.
+///////////////////////////////////////////////////////////////////////////////
+static FILE* sink_file = NULL;
+static int sink_format = FRAME_SINK_PPM;
+static int sink_width = 0;
+static int sink_height = 0;
+
+static uint8_t* frame_buffers[FRAME_SINK_QUEUE_SIZE];
+static int free_frames[FRAME_SINK_QUEUE_SIZE];
+static int num_free_frames = 0;
+static int queued_frames[FRAME_SINK_QUEUE_SIZE];
+static int num_queued_frames = 0;
+static int num_dropped_frames = 0;
+
+static uint8_t* row_buffer = NULL;
+static uint8_t* plane_buffer = NULL;
+
+static SDL_Thread* writer_thread = NULL;
+static SDL_mutex* sink_mutex = NULL;
+static SDL_cond* sink_cond = NULL;
+static bool is_sink_closing = false;
+
+static void write_ppm_frame(const uint8_t* rgba) {
+	fprintf(sink_file, "P6\n%d %d\n255\n", sink_width, sink_height);
+	for (int y = 0; y < sink_height; y++) {
+		const uint8_t* pixel = &rgba[y * sink_width * 4];
+		for (int x = 0; x < sink_width; x++) {
+			row_buffer[x * 3 + 0] = pixel[x * 4 + 0];
+			row_buffer[x * 3 + 1] = pixel[x * 4 + 1];
+			row_buffer[x * 3 + 2] = pixel[x * 4 + 2];
+		}
+		fwrite(row_buffer, 3, sink_width, sink_file);
+	}
+}
+
+static void write_y4m_frame(const uint8_t* rgba) {
+	int chroma_width = (sink_width + 1) / 2;
+	int chroma_height = (sink_height + 1) / 2;
+	uint8_t* luma = plane_buffer;
+	uint8_t* cb = luma + sink_width * sink_height;
+	uint8_t* cr = cb + chroma_width * chroma_height;
+
+	// Full range BT.601 (JPEG) conversion, chroma averaged over 2x2 blocks
+	for (int y = 0; y < sink_height; y++) {
+		for (int x = 0; x < sink_width; x++) {
+			const uint8_t* pixel = &rgba[(y * sink_width + x) * 4];
+			luma[y * sink_width + x] = (uint8_t)((77 * pixel[0] + 150 * pixel[1] + 29 * pixel[2] + 128) >> 8);
+		}
+	}
+	for (int y = 0; y < chroma_height; y++) {
+		for (int x = 0; x < chroma_width; x++) {
+			int r = 0, g = 0, b = 0, count = 0;
+			for (int j = 2 * y; j < 2 * y + 2 && j < sink_height; j++) {
+				for (int i = 2 * x; i < 2 * x + 2 && i < sink_width; i++) {
+					const uint8_t* pixel = &rgba[(j * sink_width + i) * 4];
+					r += pixel[0];
+					g += pixel[1];
+					b += pixel[2];
+					count++;
+				}
+			}
+			r /= count;
+			g /= count;
+			b /= count;
+			cb[y * chroma_width + x] = (uint8_t)((-43 * r - 85 * g + 128 * b + 128 * 256 + 128) >> 8);
+			cr[y * chroma_width + x] = (uint8_t)((128 * r - 107 * g - 21 * b + 128 * 256 + 128) >> 8);
+		}
+	}
+
+	fputs("FRAME\n", sink_file);
+	fwrite(plane_buffer, 1, sink_width * sink_height + 2 * chroma_width * chroma_height, sink_file);
+}
+
+static int writer_thread_main(void* data) {
+	while (true) {
+		SDL_LockMutex(sink_mutex);
+		while (num_queued_frames == 0 && !is_sink_closing) {
+			SDL_CondWait(sink_cond, sink_mutex);
+		}
+		if (num_queued_frames == 0) {
+			SDL_UnlockMutex(sink_mutex);
+			return 0;
+		}
+		int index = queued_frames[0];
+		num_queued_frames--;
+		memmove(&queued_frames[0], &queued_frames[1], sizeof(int) * num_queued_frames);
+		SDL_UnlockMutex(sink_mutex);
+
+		if (sink_format == FRAME_SINK_Y4M) {
+			write_y4m_frame(frame_buffers[index]);
+		}
+		else {
+			write_ppm_frame(frame_buffers[index]);
+		}
+
+		SDL_LockMutex(sink_mutex);
+		free_frames[num_free_frames++] = index;
+		SDL_UnlockMutex(sink_mutex);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Open the sink, the format comes from the extension (.y4m or anything else
+// for PPM). Writing to stdout ("-") always produces Y4M.
+///////////////////////////////////////////////////////////////////////////////
+bool open_frame_sink(const char* path, int width, int height, int fps) {
+	const char* extension = strrchr(path, '.');
+	bool is_stdout = strcmp(path, "-") == 0;
+	sink_format = (is_stdout || (extension && strcmp(extension, ".y4m") == 0)) ? FRAME_SINK_Y4M : FRAME_SINK_PPM;
+	sink_width = width;
+	sink_height = height;
+
+	if (is_stdout) {
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		sink_file = stdout;
+	}
+	else {
+#ifdef _WIN32
+		fopen_s(&sink_file, path, "wb");
+#else
+		sink_file = fopen(path, "wb");
+#endif
+	}
+	if (!sink_file) {
+		fprintf(stderr, "Error opening frame sink %s\n", path);
+		return false;
+	}
+
+	if (sink_format == FRAME_SINK_Y4M) {
+		fprintf(sink_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+	}
+
+	for (int i = 0; i < FRAME_SINK_QUEUE_SIZE; i++) {
+		frame_buffers[i] = (uint8_t*)malloc(width * height * 4);
+		free_frames[i] = i;
+	}
+	num_free_frames = FRAME_SINK_QUEUE_SIZE;
+	num_queued_frames = 0;
+	num_dropped_frames = 0;
+	row_buffer = (uint8_t*)malloc(width * 3);
+	plane_buffer = (uint8_t*)malloc(width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2));
+
+	is_sink_closing = false;
+	sink_mutex = SDL_CreateMutex();
+	sink_cond = SDL_CreateCond();
+	writer_thread = SDL_CreateThread(writer_thread_main, "frame sink", NULL);
+	if (!writer_thread) {
+		fprintf(stderr, "Error creating frame sink thread: %s\n", SDL_GetError());
+		close_frame_sink();
+		return false;
+	}
+
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Write the frames still queued and release everything
+///////////////////////////////////////////////////////////////////////////////
+void close_frame_sink(void) {
+	if (writer_thread) {
+		SDL_LockMutex(sink_mutex);
+		is_sink_closing = true;
+		SDL_CondSignal(sink_cond);
+		SDL_UnlockMutex(sink_mutex);
+		SDL_WaitThread(writer_thread, NULL);
+		writer_thread = NULL;
+	}
+	SDL_DestroyCond(sink_cond);
+	SDL_DestroyMutex(sink_mutex);
+	sink_cond = NULL;
+	sink_mutex = NULL;
+
+	if (sink_file) {
+		if (num_dropped_frames > 0) {
+			fprintf(stderr, "Frame sink dropped %d frames\n", num_dropped_frames);
+		}
+		if (sink_file != stdout) {
+			fclose(sink_file);
+		}
+		else {
+			fflush(sink_file);
+		}
+		sink_file = NULL;
+	}
+
+	for (int i = 0; i < FRAME_SINK_QUEUE_SIZE; i++) {
+		free(frame_buffers[i]);
+		frame_buffers[i] = NULL;
+	}
+	free(row_buffer);
+	free(plane_buffer);
+	row_buffer = NULL;
+	plane_buffer = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue a copy of a frame, or drop it if the writer is behind. The signature
+// matches the display present callback. Frames drawn at a lower resolution
+// are scaled up (nearest pixel) to the size of the stream.
+///////////////////////////////////////////////////////////////////////////////
+void submit_frame_sink(const uint32_t* pixels, int width, int height, int stride) {
+	if (!writer_thread) {
+		return;
+	}
+
+	SDL_LockMutex(sink_mutex);
+	if (num_free_frames == 0) {
+		num_dropped_frames++;
+		SDL_UnlockMutex(sink_mutex);
+		return;
+	}
+	int index = free_frames[--num_free_frames];
+	SDL_UnlockMutex(sink_mutex);
+
+	uint32_t* frame = (uint32_t*)frame_buffers[index];
+	if (width == sink_width && height == sink_height) {
+		for (int y = 0; y < height; y++) {
+			memcpy(&frame[y * width], &pixels[y * stride], width * 4);
+		}
+	}
+	else {
+		for (int y = 0; y < sink_height; y++) {
+			const uint32_t* row = &pixels[(y * height / sink_height) * stride];
+			for (int x = 0; x < sink_width; x++) {
+				frame[y * sink_width + x] = row[x * width / sink_width];
+			}
+		}
+	}
+
+	SDL_LockMutex(sink_mutex);
+	queued_frames[num_queued_frames++] = index;
+	SDL_CondSignal(sink_cond);
+	SDL_UnlockMutex(sink_mutex);
+}
+
+int get_frame_sink_dropped(void) {
+	SDL_LockMutex(sink_mutex);
+	int dropped = num_dropped_frames;
+	SDL_UnlockMutex(sink_mutex);
+	return dropped;
+}
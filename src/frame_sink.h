@@ -0,0 +1,21 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of frame buffers shared by the render loop and the writer thread
+#define FRAME_SINK_QUEUE_SIZE 4
+
+enum frame_sink_format {
+	FRAME_SINK_PPM,
+	FRAME_SINK_Y4M
+};
+
+bool open_frame_sink(const char* path, int width, int height, int fps);
+void close_frame_sink(void);
+
+void submit_frame_sink(const uint32_t* pixels, int width, int height, int stride);
+int get_frame_sink_dropped(void);
+
+#endif
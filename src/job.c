@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <SDL.h>
+#include "job.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Work-stealing thread pool. Every thread owns a deque of jobs: it takes
+// work from the bottom of its own deque and steals from the top of the others
+// when it runs out. The thread calling run_jobs works as thread 0 until the
+// whole batch is done, so a pool without workers runs everything inline.
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+	job_function_t function;
+	void* data;
+	int index;
+} job_t;
+
+typedef struct {
+	job_t* jobs;
+	int capacity;
+	int top;
+	int bottom;
+	SDL_SpinLock lock;
+} job_deque_t;
+
+static job_deque_t deques[MAX_JOB_THREADS];
+static SDL_Thread* workers[MAX_JOB_THREADS];
+static int num_threads = 1;
+
+static SDL_mutex* mutex = NULL;
+static SDL_cond* work_cond = NULL;
+static SDL_cond* done_cond = NULL;
+static int batch_generation = 0;
+static bool is_quitting = false;
+static SDL_atomic_t pending_jobs;
+
+static void push_job(job_deque_t* deque, job_t job) {
+	SDL_AtomicLock(&deque->lock);
+	if (deque->top > 0 && deque->top == deque->bottom) {
+		deque->top = 0;
+		deque->bottom = 0;
+	}
+	if (deque->bottom == deque->capacity) {
+		deque->capacity = deque->capacity > 0 ? deque->capacity * 2 : 64;
+		deque->jobs = (job_t*)realloc(deque->jobs, sizeof(job_t) * deque->capacity);
+	}
+	deque->jobs[deque->bottom++] = job;
+	SDL_AtomicUnlock(&deque->lock);
+}
+
+static bool pop_job(job_deque_t* deque, job_t* job) {
+	bool found = false;
+	SDL_AtomicLock(&deque->lock);
+	if (deque->bottom > deque->top) {
+		*job = deque->jobs[--deque->bottom];
+		found = true;
+	}
+	SDL_AtomicUnlock(&deque->lock);
+	return found;
+}
+
+static bool steal_job(job_deque_t* deque, job_t* job) {
+	bool found = false;
+	SDL_AtomicLock(&deque->lock);
+	if (deque->bottom > deque->top) {
+		*job = deque->jobs[deque->top++];
+		found = true;
+	}
+	SDL_AtomicUnlock(&deque->lock);
+	return found;
+}
+
+static void execute_jobs(int thread_index) {
+	job_t job;
+	while (true) {
+		bool found = pop_job(&deques[thread_index], &job);
+
+		// Own deque is empty: try the other threads, starting with the next one
+		for (int i = 1; !found && i < num_threads; i++) {
+			found = steal_job(&deques[(thread_index + i) % num_threads], &job);
+		}
+		if (!found) {
+			return;
+		}
+
+		job.function(job.data, job.index, thread_index);
+
+		// The thread finishing the last job wakes up the caller of run_jobs
+		if (SDL_AtomicAdd(&pending_jobs, -1) == 1) {
+			SDL_LockMutex(mutex);
+			SDL_CondSignal(done_cond);
+			SDL_UnlockMutex(mutex);
+		}
+	}
+}
+
+static int worker_main(void* data) {
+	int thread_index = (int)(intptr_t)data;
+	int seen_generation = 0;
+
+	while (true) {
+		SDL_LockMutex(mutex);
+		while (!is_quitting && seen_generation == batch_generation) {
+			SDL_CondWait(work_cond, mutex);
+		}
+		seen_generation = batch_generation;
+		bool quit = is_quitting;
+		SDL_UnlockMutex(mutex);
+
+		if (quit) {
+			return 0;
+		}
+		execute_jobs(thread_index);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start the pool; a negative number of workers uses one per additional core
+///////////////////////////////////////////////////////////////////////////////
+bool init_job_system(int num_workers) {
+	if (num_workers < 0) {
+		num_workers = SDL_GetCPUCount() - 1;
+	}
+	if (num_workers > MAX_JOB_THREADS - 1) {
+		num_workers = MAX_JOB_THREADS - 1;
+	}
+
+	mutex = SDL_CreateMutex();
+	work_cond = SDL_CreateCond();
+	done_cond = SDL_CreateCond();
+	if (!mutex || !work_cond || !done_cond) {
+		fprintf(stderr, "Error creating the job system synchronization objects.\n");
+		return false;
+	}
+	SDL_AtomicSet(&pending_jobs, 0);
+
+	num_threads = 1;
+	for (int i = 1; i <= num_workers; i++) {
+		workers[i] = SDL_CreateThread(worker_main, "job worker", (void*)(intptr_t)i);
+		if (!workers[i]) {
+			// Keep going with the workers started so far
+			fprintf(stderr, "Error creating job worker thread: %s\n", SDL_GetError());
+			break;
+		}
+		num_threads++;
+	}
+
+	return true;
+}
+
+void destroy_job_system(void) {
+	if (mutex) {
+		SDL_LockMutex(mutex);
+		is_quitting = true;
+		SDL_CondBroadcast(work_cond);
+		SDL_UnlockMutex(mutex);
+	}
+
+	for (int i = 1; i < num_threads; i++) {
+		SDL_WaitThread(workers[i], NULL);
+	}
+	for (int i = 0; i < MAX_JOB_THREADS; i++) {
+		free(deques[i].jobs);
+		deques[i].jobs = NULL;
+		deques[i].capacity = 0;
+	}
+
+	SDL_DestroyCond(done_cond);
+	SDL_DestroyCond(work_cond);
+	SDL_DestroyMutex(mutex);
+	done_cond = NULL;
+	work_cond = NULL;
+	mutex = NULL;
+	num_threads = 1;
+	is_quitting = false;
+}
+
+int get_num_job_threads(void) {
+	return num_threads;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run function(data, 0..num_jobs-1) across the pool and wait for all of them.
+// Jobs are handed out in contiguous blocks, so neighbouring jobs tend to run on
+// the same thread unless they get stolen.
+///////////////////////////////////////////////////////////////////////////////
+void run_jobs(job_function_t function, void* data, int num_jobs) {
+	if (num_jobs <= 0) {
+		return;
+	}
+
+	SDL_AtomicSet(&pending_jobs, num_jobs);
+
+	// Push each block in reverse so the owner pops its jobs in increasing order
+	for (int t = 0; t < num_threads; t++) {
+		int first = num_jobs * t / num_threads;
+		int last = num_jobs * (t + 1) / num_threads;
+		for (int i = last - 1; i >= first; i--) {
+			job_t job = { function, data, i };
+			push_job(&deques[t], job);
+		}
+	}
+
+	if (num_threads > 1) {
+		SDL_LockMutex(mutex);
+		batch_generation++;
+		SDL_CondBroadcast(work_cond);
+		SDL_UnlockMutex(mutex);
+	}
+
+	execute_jobs(0);
+
+	// Wait for the jobs still running on (or stolen by) the workers
+	SDL_LockMutex(mutex);
+	while (SDL_AtomicGet(&pending_jobs) > 0) {
+		SDL_CondWait(done_cond, mutex);
+	}
+	SDL_UnlockMutex(mutex);
+}
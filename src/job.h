@@ -0,0 +1,18 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdbool.h>
+
+#define MAX_JOB_THREADS 32
+
+// Job callback: index is the job number inside the batch, thread_index
+// identifies the executing thread (0 is the thread that called run_jobs)
+typedef void (*job_function_t)(void* data, int index, int thread_index);
+
+bool init_job_system(int num_workers);
+void destroy_job_system(void);
+int get_num_job_threads(void);
+
+void run_jobs(job_function_t function, void* data, int num_jobs);
+
+#endif
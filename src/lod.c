@@ -0,0 +1,491 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "lod.h"
+#include "array.h"
+
+// Symmetric 4x4 matrix accumulating the squared distance to a set of planes
+typedef struct {
+	double a2, ab, ac, ad;
+	double b2, bc, bd;
+	double c2, cd;
+	double d2;
+} quadric_t;
+
+// Half-edge collapse: vertex "from" is merged into vertex "to"
+typedef struct {
+	int from;
+	int to;
+	double cost;
+} collapse_t;
+
+// Undirected edge (smaller index in the upper half of the key) and the face using it
+typedef struct {
+	unsigned long long key;
+	int face;
+} edge_t;
+
+// Face being simplified: the corners index position groups (vertices sharing
+// a position are one group, so the surface stays connected across UV seams)
+// and every corner also keeps the mesh vertex, with its texture coordinate,
+// that it uses
+typedef struct {
+	int a;
+	int b;
+	int c;
+	int vertices[3];
+} lod_face_t;
+
+// Open boundaries are kept in place by planes perpendicular to the boundary faces
+#define BOUNDARY_WEIGHT 10.0
+
+// Removed faces are flagged in place until the end of every collapse pass
+#define REMOVED_FACE -1
+
+static void quadric_add_plane(quadric_t* q, vec3_t normal, vec3_t point, double weight) {
+	// Plane equation ax + by + cz + d = 0 with a unit normal
+	double a = normal.x;
+	double b = normal.y;
+	double c = normal.z;
+	double d = -(a * point.x + b * point.y + c * point.z);
+
+	q->a2 += weight * a * a; q->ab += weight * a * b; q->ac += weight * a * c; q->ad += weight * a * d;
+	q->b2 += weight * b * b; q->bc += weight * b * c; q->bd += weight * b * d;
+	q->c2 += weight * c * c; q->cd += weight * c * d;
+	q->d2 += weight * d * d;
+}
+
+static void quadric_add(quadric_t* q, const quadric_t* r) {
+	q->a2 += r->a2; q->ab += r->ab; q->ac += r->ac; q->ad += r->ad;
+	q->b2 += r->b2; q->bc += r->bc; q->bd += r->bd;
+	q->c2 += r->c2; q->cd += r->cd;
+	q->d2 += r->d2;
+}
+
+static double quadric_error(const quadric_t* q, vec3_t v) {
+	double x = v.x;
+	double y = v.y;
+	double z = v.z;
+	return q->a2 * x * x + 2 * q->ab * x * y + 2 * q->ac * x * z + 2 * q->ad * x
+		+ q->b2 * y * y + 2 * q->bc * y * z + 2 * q->bd * y
+		+ q->c2 * z * z + 2 * q->cd * z
+		+ q->d2;
+}
+
+static double get_collapse_cost(quadric_t* quadrics, vec3_t* vertices, int from, int to) {
+	quadric_t q = quadrics[from];
+	quadric_add(&q, &quadrics[to]);
+	return quadric_error(&q, vertices[to]);
+}
+
+static int* face_index(lod_face_t* face, int corner) {
+	return corner == 0 ? &face->a : (corner == 1 ? &face->b : &face->c);
+}
+
+static int find_corner(lod_face_t* face, int vertex) {
+	return face->a == vertex ? 0 : (face->b == vertex ? 1 : (face->c == vertex ? 2 : -1));
+}
+
+static bool is_same_uv(tex2_t a, tex2_t b) {
+	return a.u == b.u && a.v == b.v;
+}
+
+static vec3_t get_face_normal(vec3_t* vertices, lod_face_t* face) {
+	vec3_t normal = vec3_cross(vec3_sub(vertices[face->b], vertices[face->a]), vec3_sub(vertices[face->c], vertices[face->a]));
+	float length = vec3_length(normal);
+	return length > 0 ? vec3_div(normal, length) : normal;
+}
+
+static int compare_collapses(const void* a, const void* b) {
+	double cost_a = ((const collapse_t*)a)->cost;
+	double cost_b = ((const collapse_t*)b)->cost;
+	return (cost_a > cost_b) - (cost_a < cost_b);
+}
+
+static int compare_edges(const void* a, const void* b) {
+	unsigned long long edge_a = ((const edge_t*)a)->key;
+	unsigned long long edge_b = ((const edge_t*)b)->key;
+	return (edge_a > edge_b) - (edge_a < edge_b);
+}
+
+static vec3_t* sorted_positions;
+
+static int compare_positions(const void* a, const void* b) {
+	vec3_t position_a = sorted_positions[*(const int*)a];
+	vec3_t position_b = sorted_positions[*(const int*)b];
+	if (position_a.x != position_b.x) {
+		return position_a.x < position_b.x ? -1 : 1;
+	}
+	if (position_a.y != position_b.y) {
+		return position_a.y < position_b.y ? -1 : 1;
+	}
+	if (position_a.z != position_b.z) {
+		return position_a.z < position_b.z ? -1 : 1;
+	}
+	return (*(const int*)a > *(const int*)b) - (*(const int*)a < *(const int*)b);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Map every vertex to the first vertex with the same position, so the welded
+// copies along UV seams simplify as one point
+///////////////////////////////////////////////////////////////////////////////
+static int* get_position_groups(vec3_t* vertices, int num_vertices) {
+	int* order = (int*)malloc(sizeof(int) * (num_vertices + 1));
+	int* groups = (int*)malloc(sizeof(int) * (num_vertices + 1));
+	for (int i = 0; i < num_vertices; i++) {
+		order[i] = i;
+	}
+
+	sorted_positions = vertices;
+	qsort(order, num_vertices, sizeof(int), compare_positions);
+
+	for (int i = 0; i < num_vertices; i++) {
+		bool is_same_position = i > 0 &&
+			vertices[order[i]].x == vertices[order[i - 1]].x &&
+			vertices[order[i]].y == vertices[order[i - 1]].y &&
+			vertices[order[i]].z == vertices[order[i - 1]].z;
+		groups[order[i]] = is_same_position ? groups[order[i - 1]] : order[i];
+	}
+
+	free(order);
+	return groups;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Accumulate the face planes into the vertex quadrics. Boundary edges (used by
+// a single face) add a heavily weighted plane perpendicular to their face, and
+// the vertices of non-manifold edges are locked in place.
+///////////////////////////////////////////////////////////////////////////////
+static void compute_vertex_quadrics(lod_face_t* faces, int num_faces, vec3_t* vertices, int num_vertices, quadric_t* quadrics, bool* locked) {
+	edge_t* edges = (edge_t*)malloc(sizeof(edge_t) * num_faces * 3);
+
+	for (int i = 0; i < num_vertices; i++) {
+		locked[i] = false;
+		memset(&quadrics[i], 0, sizeof(quadric_t));
+	}
+
+	for (int i = 0; i < num_faces; i++) {
+		vec3_t normal = get_face_normal(vertices, &faces[i]);
+		for (int k = 0; k < 3; k++) {
+			unsigned int v0 = *face_index(&faces[i], k);
+			unsigned int v1 = *face_index(&faces[i], (k + 1) % 3);
+			quadric_add_plane(&quadrics[v0], normal, vertices[v0], 1.0);
+
+			edges[i * 3 + k].key = v0 < v1 ? ((unsigned long long)v0 << 32) | v1 : ((unsigned long long)v1 << 32) | v0;
+			edges[i * 3 + k].face = i;
+		}
+	}
+
+	// Every manifold interior edge is shared by exactly two faces
+	qsort(edges, num_faces * 3, sizeof(edge_t), compare_edges);
+	for (int i = 0; i < num_faces * 3;) {
+		int j = i;
+		while (j < num_faces * 3 && edges[j].key == edges[i].key) {
+			j++;
+		}
+
+		int v0 = (int)(edges[i].key >> 32);
+		int v1 = (int)(edges[i].key & 0xFFFFFFFF);
+		if (j - i == 1) {
+			vec3_t edge_direction = vec3_sub(vertices[v1], vertices[v0]);
+			vec3_t normal = vec3_cross(edge_direction, get_face_normal(vertices, &faces[edges[i].face]));
+			float length = vec3_length(normal);
+			if (length > 0) {
+				normal = vec3_div(normal, length);
+				quadric_add_plane(&quadrics[v0], normal, vertices[v0], BOUNDARY_WEIGHT);
+				quadric_add_plane(&quadrics[v1], normal, vertices[v0], BOUNDARY_WEIGHT);
+			}
+		}
+		else if (j - i > 2) {
+			locked[v0] = true;
+			locked[v1] = true;
+		}
+		i = j;
+	}
+
+	free(edges);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check that "from" can be merged into "to" without tearing the texture or
+// flipping a face. The faces around "from" are grouped into UV charts by the
+// texture coordinate they use for "from"; every chart must contain a face on
+// the collapsed edge, which gives the vertex of "to" in that chart. This lets
+// vertices slide along UV seams but never across them.
+///////////////////////////////////////////////////////////////////////////////
+static bool can_collapse(lod_face_t* faces, int* around, int around_count, vec3_t* vertices, tex2_t* uvs, int from, int to) {
+	for (int i = 0; i < around_count; i++) {
+		lod_face_t* face = &faces[around[i]];
+		if (face->a == REMOVED_FACE || find_corner(face, to) >= 0) {
+			continue;
+		}
+
+		// The chart of this face must also be present on the collapsed edge
+		tex2_t from_uv = uvs[face->vertices[find_corner(face, from)]];
+		bool has_chart = false;
+		for (int j = 0; j < around_count && !has_chart; j++) {
+			lod_face_t* edge_face = &faces[around[j]];
+			if (edge_face->a != REMOVED_FACE && find_corner(edge_face, to) >= 0) {
+				has_chart = is_same_uv(uvs[edge_face->vertices[find_corner(edge_face, from)]], from_uv);
+			}
+		}
+		if (!has_chart) {
+			return false;
+		}
+
+		vec3_t p0 = vertices[face->a];
+		vec3_t p1 = vertices[face->b];
+		vec3_t p2 = vertices[face->c];
+		vec3_t normal_before = vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0));
+
+		p0 = face->a == from ? vertices[to] : p0;
+		p1 = face->b == from ? vertices[to] : p1;
+		p2 = face->c == from ? vertices[to] : p2;
+		vec3_t normal_after = vec3_cross(vec3_sub(p1, p0), vec3_sub(p2, p0));
+
+		if (vec3_dot(normal_before, normal_after) <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Merge "from" into "to": faces on the collapsed edge are removed, the other
+// faces around "from" take the vertex of "to" in their chart.
+// Returns the number of removed faces.
+///////////////////////////////////////////////////////////////////////////////
+static int collapse_edge(lod_face_t* faces, int* around, int around_count, tex2_t* uvs, int from, int to) {
+	int removed_faces = 0;
+
+	for (int i = 0; i < around_count; i++) {
+		lod_face_t* face = &faces[around[i]];
+		if (face->a == REMOVED_FACE || find_corner(face, to) >= 0) {
+			continue;
+		}
+
+		int corner = find_corner(face, from);
+		tex2_t from_uv = uvs[face->vertices[corner]];
+		for (int j = 0; j < around_count; j++) {
+			lod_face_t* edge_face = &faces[around[j]];
+			if (edge_face->a != REMOVED_FACE && find_corner(edge_face, to) >= 0 &&
+				is_same_uv(uvs[edge_face->vertices[find_corner(edge_face, from)]], from_uv)) {
+				face->vertices[corner] = edge_face->vertices[find_corner(edge_face, to)];
+				break;
+			}
+		}
+		*face_index(face, corner) = to;
+	}
+
+	for (int i = 0; i < around_count; i++) {
+		lod_face_t* face = &faces[around[i]];
+		if (face->a != REMOVED_FACE && find_corner(face, to) >= 0 && find_corner(face, from) >= 0) {
+			face->a = REMOVED_FACE;
+			removed_faces++;
+		}
+	}
+
+	return removed_faces;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Quadric error metric simplification (Garland & Heckbert) with half-edge
+// collapses, so every level keeps indexing the original vertex array.
+// Collapses run in passes: all candidate edges are sorted by error and the
+// cheapest ones are applied, each pass touching a vertex neighbourhood at most
+// once. Returns a new array of faces, or NULL if nothing could be collapsed.
+///////////////////////////////////////////////////////////////////////////////
+static face_t* simplify_faces(face_t* source_faces, vec3_t* vertices, tex2_t* uvs, int* position_groups, int num_vertices, int target_faces, double max_error) {
+	int num_faces = array_length(source_faces);
+	int num_source_faces = num_faces;
+
+	lod_face_t* faces = (lod_face_t*)malloc(sizeof(lod_face_t) * (num_faces + 1));
+	for (int i = 0; i < num_faces; i++) {
+		face_t face = source_faces[i];
+		faces[i] = (lod_face_t){
+			.a = position_groups[face.a],
+			.b = position_groups[face.b],
+			.c = position_groups[face.c],
+			.vertices = { face.a, face.b, face.c }
+		};
+	}
+
+	quadric_t* quadrics = (quadric_t*)malloc(sizeof(quadric_t) * num_vertices);
+	bool* locked = (bool*)malloc(sizeof(bool) * num_vertices);
+	compute_vertex_quadrics(faces, num_faces, vertices, num_vertices, quadrics, locked);
+
+	bool* pass_locked = (bool*)malloc(sizeof(bool) * num_vertices);
+	int* adjacency_offsets = (int*)malloc(sizeof(int) * (num_vertices + 1));
+	int* adjacency = (int*)malloc(sizeof(int) * num_faces * 3);
+	collapse_t* collapses = (collapse_t*)malloc(sizeof(collapse_t) * num_faces * 6);
+
+	while (num_faces > target_faces) {
+		// Vertex to face adjacency of the current faces
+		memset(adjacency_offsets, 0, sizeof(int) * (num_vertices + 1));
+		for (int i = 0; i < num_faces; i++) {
+			adjacency_offsets[faces[i].a + 1]++;
+			adjacency_offsets[faces[i].b + 1]++;
+			adjacency_offsets[faces[i].c + 1]++;
+		}
+		for (int i = 0; i < num_vertices; i++) {
+			adjacency_offsets[i + 1] += adjacency_offsets[i];
+		}
+		for (int i = 0; i < num_faces; i++) {
+			for (int k = 0; k < 3; k++) {
+				adjacency[adjacency_offsets[*face_index(&faces[i], k)]++] = i;
+			}
+		}
+		for (int i = num_vertices; i > 0; i--) {
+			adjacency_offsets[i] = adjacency_offsets[i - 1];
+		}
+		adjacency_offsets[0] = 0;
+
+		// Candidate collapses in both directions of every edge
+		int num_collapses = 0;
+		for (int i = 0; i < num_faces; i++) {
+			for (int k = 0; k < 3; k++) {
+				int v0 = *face_index(&faces[i], k);
+				int v1 = *face_index(&faces[i], (k + 1) % 3);
+				if (!locked[v0]) {
+					collapse_t collapse = { v0, v1, get_collapse_cost(quadrics, vertices, v0, v1) };
+					collapses[num_collapses++] = collapse;
+				}
+				if (!locked[v1]) {
+					collapse_t collapse = { v1, v0, get_collapse_cost(quadrics, vertices, v1, v0) };
+					collapses[num_collapses++] = collapse;
+				}
+			}
+		}
+		qsort(collapses, num_collapses, sizeof(collapse_t), compare_collapses);
+
+		for (int i = 0; i < num_vertices; i++) {
+			pass_locked[i] = false;
+		}
+
+		int remaining_faces = num_faces;
+		for (int i = 0; i < num_collapses && remaining_faces > target_faces; i++) {
+			collapse_t collapse = collapses[i];
+			if (collapse.cost > max_error) {
+				break;
+			}
+			if (pass_locked[collapse.from] || pass_locked[collapse.to]) {
+				continue;
+			}
+
+			int* around = &adjacency[adjacency_offsets[collapse.from]];
+			int around_count = adjacency_offsets[collapse.from + 1] - adjacency_offsets[collapse.from];
+			if (!can_collapse(faces, around, around_count, vertices, uvs, collapse.from, collapse.to)) {
+				continue;
+			}
+
+			// Lock the whole neighbourhood so later collapses in this pass see valid faces
+			for (int j = 0; j < around_count; j++) {
+				lod_face_t* face = &faces[around[j]];
+				if (face->a != REMOVED_FACE) {
+					pass_locked[face->a] = true;
+					pass_locked[face->b] = true;
+					pass_locked[face->c] = true;
+				}
+			}
+
+			remaining_faces -= collapse_edge(faces, around, around_count, uvs, collapse.from, collapse.to);
+			quadric_add(&quadrics[collapse.to], &quadrics[collapse.from]);
+		}
+
+		if (remaining_faces == num_faces) {
+			break;
+		}
+
+		// Compact the faces that survived this pass
+		int num_kept = 0;
+		for (int i = 0; i < num_faces; i++) {
+			if (faces[i].a != REMOVED_FACE) {
+				faces[num_kept++] = faces[i];
+			}
+		}
+		num_faces = num_kept;
+	}
+
+	face_t* result = NULL;
+	if (num_faces < num_source_faces) {
+		result = array_hold(NULL, num_faces, sizeof(face_t));
+		for (int i = 0; i < num_faces; i++) {
+			result[i] = (face_t){ faces[i].vertices[0], faces[i].vertices[1], faces[i].vertices[2] };
+		}
+	}
+
+	free(collapses);
+	free(adjacency);
+	free(adjacency_offsets);
+	free(pass_locked);
+	free(locked);
+	free(quadrics);
+	free(faces);
+
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Build the level of detail chain. Level 0 uses the authored faces and every
+// following level is simplified from the previous one. All levels share the
+// mesh vertices and are split into meshlets for culling.
+///////////////////////////////////////////////////////////////////////////////
+void build_mesh_lods(mesh_t* mesh) {
+	int num_vertices = array_length(mesh->vertices);
+	int* position_groups = get_position_groups(mesh->vertices, num_vertices);
+	double max_error = LOD_MAX_ERROR * mesh->bounds_radius;
+	max_error *= max_error;
+
+	mesh->lods[0].faces = mesh->faces;
+	mesh->lods[0].num_faces = array_length(mesh->faces);
+	mesh->lods[0].meshlets = build_meshlets(mesh->faces, mesh->vertices);
+	mesh->num_lods = 1;
+
+	while (mesh->num_lods < MAX_NUM_LODS) {
+		face_t* previous_faces = mesh->lods[mesh->num_lods - 1].faces;
+		int num_previous_faces = array_length(previous_faces);
+		if (num_previous_faces == 0) {
+			break;
+		}
+
+		int target_faces = (int)(num_previous_faces * LOD_REDUCTION);
+		face_t* faces = simplify_faces(previous_faces, mesh->vertices, mesh->uvs, position_groups, num_vertices, target_faces, max_error);
+		if (faces == NULL) {
+			break;
+		}
+		if (array_length(faces) > num_previous_faces * LOD_MIN_REDUCTION) {
+			array_free(faces);
+			break;
+		}
+
+		mesh->lods[mesh->num_lods].faces = faces;
+		mesh->lods[mesh->num_lods].num_faces = array_length(faces);
+		mesh->lods[mesh->num_lods].meshlets = build_meshlets(faces, mesh->vertices);
+		mesh->num_lods++;
+	}
+
+	free(position_groups);
+}
+
+static float get_lod_triangle_area(mesh_t* mesh, int lod, float screen_area) {
+	// Only about half of the faces of a closed mesh face the camera
+	return screen_area / (mesh->lods[lod].num_faces * 0.5f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Update the level selected by an object from the projected bounding sphere
+// radius (in pixels), so the average triangle keeps covering about
+// LOD_MIN_TRIANGLE_AREA pixels
+///////////////////////////////////////////////////////////////////////////////
+void update_mesh_lod(mesh_t* mesh, int* lod, float screen_radius) {
+	float screen_area = 3.14159265f * screen_radius * screen_radius;
+
+	while (*lod + 1 < mesh->num_lods &&
+		get_lod_triangle_area(mesh, *lod, screen_area) < LOD_MIN_TRIANGLE_AREA * (1 - LOD_HYSTERESIS)) {
+		(*lod)++;
+	}
+	while (*lod > 0 &&
+		get_lod_triangle_area(mesh, *lod - 1, screen_area) > LOD_MIN_TRIANGLE_AREA * (1 + LOD_HYSTERESIS)) {
+		(*lod)--;
+	}
+}
@@ -0,0 +1,24 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "mesh.h"
+
+// Every level keeps about half the faces of the previous one
+#define LOD_REDUCTION 0.5f
+
+// A level is only kept if it removes at least a quarter of the faces
+#define LOD_MIN_REDUCTION 0.75f
+
+// Collapses moving the surface further than this fraction of the mesh radius are rejected
+#define LOD_MAX_ERROR 0.05f
+
+// Levels are chosen so a triangle covers at least this many pixels on screen
+#define LOD_MIN_TRIANGLE_AREA 8.0f
+
+// Relative margin around the switch points that keeps levels from popping back and forth
+#define LOD_HYSTERESIS 0.25f
+
+void build_mesh_lods(mesh_t* mesh);
+void update_mesh_lod(mesh_t* mesh, int* lod, float screen_radius);
+
+#endif
@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <SDL.h>
 #include "array.h"
 #include "display.h"
@@ -10,22 +13,153 @@
 #include "light.h"
 #include "camera.h"
 #include "clipping.h"
+#include "occlusion.h"
+#include "lod.h"
+#include "job.h"
+#include "frame_sink.h"
+#include "resolution.h"
+#include "pacer.h"
+#include "quantize.h"
+#include "scene.h"
+#include "texture.h"
 
-#define MAX_TRIANGLES_TO_RENDER 10000
-triangle_t triangles_to_render[MAX_TRIANGLES_TO_RENDER];
-int num_triangles_to_render = 0;
+///////////////////////////////////////////////////////////////////////////////
+// Frames are pipelined: the geometry stage (update) runs on its own thread and
+// fills one frame while the main thread rasterizes the other one. The camera
+// is snapshotted into the frame before the geometry stage starts, so input
+// handling never races with the transforms. FRAME_LATENCY 0 waits for the
+// geometry of a frame before drawing it (no overlap), FRAME_LATENCY 1 draws
+// the previous frame while the next one is transformed.
+///////////////////////////////////////////////////////////////////////////////
+#define FRAME_LATENCY 1
+
+typedef struct {
+	mat4_t view_matrix;
+	vec3_t camera_position;
+	int render_width;
+	int render_height;
+	bool is_full_redraw; // something other than the object transforms changed
+	bool is_occlusion_culling; // only when triangles are filled, wireframes have no depth test
+	bool* is_object_changed; // transform of every object changed since the previous frame
+	triangle_t* triangles_to_render;
+} frame_t;
+
+frame_t frames[2];
+frame_t* geometry_frame = &frames[0];
+
+SDL_Thread* geometry_thread = NULL;
+SDL_sem* geometry_start = NULL;
+SDL_sem* geometry_done = NULL;
+bool is_geometry_quitting = false;
 
-mat4_t world_matrix;
 mat4_t proj_matrix;
 mat4_t view_matrix;
 
+// The scene is simulated in fixed steps, independent of the frame rate
+#define SIMULATION_STEP (1.0 / 120.0)
+#define SIMULATION_MAX_STEPS 8
+
 bool is_running = false;
-int previous_frame_time = 0;
 float delta_time = 0;
+double simulation_time_left = 0;
+
+// Frames are only drawn again when something visible changed
+bool is_idle_skipping = true;
+bool is_redraw_needed = true;
+float* scene_state = NULL;
+float* previous_scene_state = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Dirty rectangles: when only some objects move, the previous and current
+// screen bounds of those objects are redrawn and the rest of the image is kept
+// from the previous frames (see begin_dirty_region in the display)
+///////////////////////////////////////////////////////////////////////////////
+#define OBJECT_STATE_VALUES 9 // scale, rotation and translation
+#define DIRTY_RECT_MARGIN 3 // pixels, covers the rounding of lines and the vertex points
+
+typedef struct {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+} screen_rect_t;
+
+bool is_dirty_rendering = false;
+bool is_quantized_storage = false;
+screen_rect_t* object_bounds = NULL;
+screen_rect_t* previous_object_bounds = NULL;
+
+// Command line options
+const char* scene_path = "./assets/default.scene";
+bool is_frame_rate_capped = true;
+int max_frames = 0; // 0 runs until the window is closed
+const char* capture_path = NULL;
+float min_resolution_scale = 1;
+float max_resolution_scale = 1;
+
+///////////////////////////////////////////////////////////////////////////////
+// Geometry jobs: the visible meshlets of every object are queued as face ranges,
+// grouped into jobs of about GEOMETRY_JOB_FACES faces and run on the job
+// system. Every thread appends to its own triangle buffer and the buffers are
+// concatenated in job order, so the output doesn't depend on the scheduling.
+// Before the faces, the vertices used by the level of detail of every drawn
+// object are brought to camera space in jobs of GEOMETRY_JOB_VERTICES, so a
+// vertex shared by several faces is only transformed once.
+//
+// Objects sharing a mesh are instances: each one only costs its own vertex
+// transform (one combined matrix per vertex) and the faces it keeps. Instances
+// that are small on screen and fully inside the view skip the per-meshlet tests,
+// which would cost them more than the faces they could save.
+///////////////////////////////////////////////////////////////////////////////
+#define NUM_JOB_WORKERS -1 // one worker per additional core
+#define GEOMETRY_JOB_FACES 256
+#define GEOMETRY_JOB_VERTICES 1024
+#define MESHLET_CULL_MIN_SCREEN_RADIUS 32 // pixels
+
+typedef struct {
+	mesh_t* mesh;
+	int object_index;
+	upng_t* texture;
+	face_t* faces;
+	uint16_t* short_indices; // used instead of the faces when not NULL
+	mat4_t world_view_matrix; // model space straight to camera space
+	int first_vertex; // camera space vertices of the object in view_vertices
+} mesh_draw_t;
+
+typedef struct {
+	int draw;
+	int first_vertex;
+	int last_vertex;
+} vertex_range_t;
+
+typedef struct {
+	int draw;
+	int first_face;
+	int last_face;
+} face_range_t;
+
+typedef struct {
+	int first_range;
+	int last_range;
+	int num_faces;
+	int thread_index;
+	int first_triangle;
+	int num_triangles;
+} geometry_job_t;
+
+mesh_draw_t* mesh_draws = NULL;
+face_range_t* face_ranges = NULL;
+geometry_job_t* geometry_jobs = NULL;
+vertex_range_t* vertex_jobs = NULL;
+vec4_t* view_vertices = NULL;
+triangle_t* thread_triangles[MAX_JOB_THREADS];
+
+void process_meshlet_faces(mesh_draw_t* draw, int first_face, int last_face, triangle_t** triangles);
 
 void setup(void) {
 	set_render_method(RENDER_WIRE);
 	set_cull_method(CULL_BACKFACE);
+	set_present_mode(PRESENT_FIFO);
 
 	init_light(vec3_new(0, 0, 1));
 
@@ -40,9 +174,22 @@ void setup(void) {
 
 	// Initialize frustum planes with a point and a normal
 	init_frustum_planes(fovx, fovy, z_near, z_far);
+
+	// The occlusion buffer projects bounding spheres with the same projection
+	init_occlusion_buffer(proj_matrix, z_near);
+
+	init_job_system(NUM_JOB_WORKERS);
 	
-	load_mesh("./assets/f22.obj", "./assets/f22.png", vec3_new(1, 1, 1), vec3_new(-3, 0, 8), vec3_new(0, 0, 0));
-	load_mesh("./assets/efa.obj", "./assets/efa.png", vec3_new(1, 1, 1), vec3_new(+3, 0, 8), vec3_new(0, 0, 0));
+	if (!load_scene(scene_path)) {
+		is_running = false;
+		return;
+	}
+
+	if (is_quantized_storage) {
+		for (int i = 0; i < get_num_meshes(); i++) {
+			quantize_mesh(get_mesh(i));
+		}
+	}
 }
 
 void process_input(void) {
@@ -52,6 +199,10 @@ void process_input(void) {
 		case SDL_QUIT:
 			is_running = false;
 			break;
+		case SDL_WINDOWEVENT:
+			// The window contents may have been lost (exposed, resized, restored)
+			is_redraw_needed = true;
+			break;
 		case SDL_KEYDOWN:
 		{
 			switch (event.key.keysym.sym) {
@@ -82,6 +233,9 @@ void process_input(void) {
 			case SDLK_x:
 				set_cull_method(CULL_NONE);
 				break;
+			case SDLK_o:
+				set_occlusion_culling(!is_occlusion_culling());
+				break;
 			case SDLK_UP:
 			{
 				update_camera_forward_velocity(vec3_mul(get_camera_direction(), 5.0 * delta_time));
@@ -125,6 +279,108 @@ void process_input(void) {
 	}
 }
 
+void queue_face_range(int draw, int first_face, int last_face) {
+	// Start a new job once the current one has enough faces
+	int num_jobs = array_length(geometry_jobs);
+	if (num_jobs == 0 || geometry_jobs[num_jobs - 1].num_faces >= GEOMETRY_JOB_FACES) {
+		geometry_job_t job = { .first_range = array_length(face_ranges), .last_range = array_length(face_ranges) };
+		array_push(geometry_jobs, job);
+		num_jobs++;
+	}
+
+	face_range_t range = { draw, first_face, last_face };
+	array_push(face_ranges, range);
+
+	geometry_jobs[num_jobs - 1].last_range++;
+	geometry_jobs[num_jobs - 1].num_faces += last_face - first_face;
+}
+
+void queue_vertex_range(int draw, int num_vertices) {
+	mesh_draws[draw].first_vertex = array_length(view_vertices);
+	view_vertices = array_hold(view_vertices, num_vertices, sizeof(vec4_t));
+
+	for (int i = 0; i < num_vertices; i += GEOMETRY_JOB_VERTICES) {
+		vertex_range_t range = { draw, i, i + GEOMETRY_JOB_VERTICES < num_vertices ? i + GEOMETRY_JOB_VERTICES : num_vertices };
+		array_push(vertex_jobs, range);
+	}
+}
+
+void process_vertex_job(void* data, int index, int thread_index) {
+	vertex_range_t* range = &vertex_jobs[index];
+	mesh_draw_t* draw = &mesh_draws[range->draw];
+
+	// Compact meshes are dequantized on the way
+	if (draw->mesh->is_quantized) {
+		transform_quantized_vertices(&draw->mesh->quantized, draw->world_view_matrix, range->first_vertex, range->last_vertex, &view_vertices[draw->first_vertex]);
+		return;
+	}
+
+	// The world and view matrices are combined, so every vertex is multiplied once
+	for (int i = range->first_vertex; i < range->last_vertex; i++) {
+		view_vertices[draw->first_vertex + i] = mat4_mul_vec4(draw->world_view_matrix, vec4_from_vec3(draw->mesh->vertices[i]));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Order the vertex jobs by mesh, so the instances of a mesh are transformed one
+// after another while its vertices are still in the cache. The jobs write to
+// their own ranges of view_vertices, so the order doesn't change the result.
+///////////////////////////////////////////////////////////////////////////////
+int compare_vertex_jobs(const void* a, const void* b) {
+	const vertex_range_t* range_a = (const vertex_range_t*)a;
+	const vertex_range_t* range_b = (const vertex_range_t*)b;
+	uintptr_t mesh_a = (uintptr_t)mesh_draws[range_a->draw].mesh;
+	uintptr_t mesh_b = (uintptr_t)mesh_draws[range_b->draw].mesh;
+	if (mesh_a != mesh_b) {
+		return mesh_a < mesh_b ? -1 : 1;
+	}
+	if (range_a->draw != range_b->draw) {
+		return range_a->draw < range_b->draw ? -1 : 1;
+	}
+	return (range_a->first_vertex > range_b->first_vertex) - (range_a->first_vertex < range_b->first_vertex);
+}
+
+void process_geometry_job(void* data, int index, int thread_index) {
+	geometry_job_t* job = &geometry_jobs[index];
+	job->thread_index = thread_index;
+	job->first_triangle = array_length(thread_triangles[thread_index]);
+
+	for (int i = job->first_range; i < job->last_range; i++) {
+		process_meshlet_faces(&mesh_draws[face_ranges[i].draw], face_ranges[i].first_face, face_ranges[i].last_face, &thread_triangles[thread_index]);
+	}
+
+	job->num_triangles = array_length(thread_triangles[thread_index]) - job->first_triangle;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the queued geometry jobs and append their triangles to the render list
+///////////////////////////////////////////////////////////////////////////////
+void flush_geometry_jobs(void) {
+	for (int i = 0; i < get_num_job_threads(); i++) {
+		array_clear(thread_triangles[i]);
+	}
+
+	// The faces read the camera space vertices, so those are done first
+	qsort(vertex_jobs, array_length(vertex_jobs), sizeof(vertex_range_t), compare_vertex_jobs);
+	run_jobs(process_vertex_job, NULL, array_length(vertex_jobs));
+
+	int num_jobs = array_length(geometry_jobs);
+	run_jobs(process_geometry_job, NULL, num_jobs);
+
+	for (int i = 0; i < num_jobs; i++) {
+		geometry_job_t* job = &geometry_jobs[i];
+		for (int j = 0; j < job->num_triangles; j++) {
+			array_push(geometry_frame->triangles_to_render, thread_triangles[job->thread_index][job->first_triangle + j]);
+		}
+	}
+
+	array_clear(mesh_draws);
+	array_clear(face_ranges);
+	array_clear(geometry_jobs);
+	array_clear(vertex_jobs);
+	array_clear(view_vertices);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Process the graphics pipeline stages for all the mesh triangles
 ///////////////////////////////////////////////////////////////////////////////
@@ -150,53 +406,140 @@ void process_input(void) {
 //                        `--> | Screen space |  <-- ready to render
 //                             +--------------+
 ///////////////////////////////////////////////////////////////////////////////
-void process_graphics_pipeline_stages(mesh_t* mesh) {
+void process_graphics_pipeline_stages(int object_index) {
+	object_t* object = get_object(object_index);
+	mesh_t* mesh = object->mesh;
+
 	// Create a scale matrix that will be used to multiply the mesh vertices
-	mat4_t scale_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
-	mat4_t translation_matrix = mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z);
-	mat4_t rotation_matrix_x = mat4_make_rotation_x(mesh->rotation.x);
-	mat4_t rotation_matrix_y = mat4_make_rotation_y(mesh->rotation.y);
-	mat4_t rotation_matrix_z = mat4_make_rotation_z(mesh->rotation.z);
+	mat4_t scale_matrix = mat4_make_scale(object->scale.x, object->scale.y, object->scale.z);
+	mat4_t translation_matrix = mat4_make_translation(object->translation.x, object->translation.y, object->translation.z);
+	mat4_t rotation_matrix_x = mat4_make_rotation_x(object->rotation.x);
+	mat4_t rotation_matrix_y = mat4_make_rotation_y(object->rotation.y);
+	mat4_t rotation_matrix_z = mat4_make_rotation_z(object->rotation.z);
 
-	// Update camera look at target to create view matrix
-	vec3_t target = get_camera_lookat_target();
-	vec3_t up_direction = vec3_new(0, 1, 0);
-	view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
-
-	int num_faces = array_length(mesh->faces);
-	for (int i = 0; i < num_faces; i++) {
-		face_t mesh_face = mesh->faces[i];
-		vec3_t face_vertices[3] = {
-			mesh->vertices[mesh_face.a],
-			mesh->vertices[mesh_face.b],
-			mesh->vertices[mesh_face.c],
-		};
+	// Create a world matrix combining scale, rotation, and translation matrices
+	mat4_t world_matrix = mat4_identity();
 
-		vec4_t transformed_vertices[3];
+	// Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
+	world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
+	world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
+	world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
 
-		// Loop all three vertices of this current face and apply transformation
-		for (int j = 0; j < 3; j++) {
-			vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
+	// Combined matrix used to bring the cluster bounds straight into camera space
+	mat4_t world_view_matrix = mat4_mul_mat4(view_matrix, world_matrix);
+
+	// Normal cones are only preserved by a uniform, non-mirroring scale
+	float max_scale = fmaxf(fabsf(object->scale.x), fmaxf(fabsf(object->scale.y), fabsf(object->scale.z)));
+	bool is_uniform_scale = object->scale.x > 0 && object->scale.x == object->scale.y && object->scale.x == object->scale.z;
+
+	// Bring the mesh bounding sphere into camera space
+	vec3_t view_center = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, vec4_from_vec3(mesh->bounds_center)));
+	float view_radius = mesh->bounds_radius * max_scale;
+
+	// Reject the whole mesh if its bounding sphere is outside the view frustum
+	if (is_sphere_outside_frustum(view_center, view_radius)) {
+		return;
+	}
+
+	// Reject the whole mesh if it is hidden behind the occluders rasterized so far
+	if (geometry_frame->is_occlusion_culling && is_sphere_occluded(view_center, view_radius)) {
+		return;
+	}
+
+	// Pick the level of detail from the size of the bounding sphere on screen
+	float screen_radius = geometry_frame->render_height;
+	if (view_center.z > view_radius) {
+		screen_radius = proj_matrix.m[1][1] * view_radius / view_center.z * (geometry_frame->render_height / 2.0);
+	}
+	update_mesh_lod(mesh, &object->lod, screen_radius);
+	mesh_lod_t* lod = &mesh->lods[object->lod];
+
+	// Large objects become occluders for the objects processed after them, so their
+	// triangles (and the ones queued before) are needed before moving on
+	bool is_occluder = geometry_frame->is_occlusion_culling && is_sphere_occluder(view_center, view_radius);
+	if (is_occluder) {
+		flush_geometry_jobs();
+	}
+	int first_triangle = array_length(geometry_frame->triangles_to_render);
 
-			// Create a world matrix combining scale, rotation, and translation matrices
-			world_matrix = mat4_identity();
+	mesh_draw_t draw = {
+		.mesh = mesh,
+		.object_index = object_index,
+		.texture = object->texture,
+		.faces = lod->faces,
+		.short_indices = lod->short_indices,
+		.world_view_matrix = world_view_matrix,
+		.first_vertex = 0
+	};
+	array_push(mesh_draws, draw);
+	int draw_index = array_length(mesh_draws) - 1;
+	int first_range = array_length(face_ranges);
 
-			// Order matters: First scale, then rotate, then translate. [T]*[R]*[S]*v
-			world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_x, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_y, world_matrix);
-			world_matrix = mat4_mul_mat4(rotation_matrix_z, world_matrix);
-			world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+	// A small instance fully inside the view queues all its faces, the faces looking away
+	// are still rejected one by one
+	if (screen_radius < MESHLET_CULL_MIN_SCREEN_RADIUS && is_sphere_inside_frustum(view_center, view_radius)) {
+		for (int i = 0; i < lod->num_faces; i += GEOMETRY_JOB_FACES) {
+			queue_face_range(draw_index, i, i + GEOMETRY_JOB_FACES < lod->num_faces ? i + GEOMETRY_JOB_FACES : lod->num_faces);
+		}
+	}
+	else {
+		int num_meshlets = array_length(lod->meshlets);
+		for (int m = 0; m < num_meshlets; m++) {
+			meshlet_t* meshlet = &lod->meshlets[m];
 
-			// Multiply the world matrix by the original vector
-			transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+			// Reject clusters outside the frustum or with all faces looking away from the camera
+			if (is_meshlet_culled(meshlet, world_view_matrix, max_scale, is_cull_backface() && is_uniform_scale, geometry_frame->is_occlusion_culling)) {
+				continue;
+			}
+
+			queue_face_range(draw_index, meshlet->first_face, meshlet->first_face + meshlet->num_faces);
+		}
+	}
 
-			// Multiply the view matrix by the vector to transform the scene to camera space
-			transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
+	// The level only uses the first vertices of the mesh, transformed once for all its faces
+	if (array_length(face_ranges) > first_range) {
+		queue_vertex_range(draw_index, lod->num_vertices);
+	}
 
-			// Save transformed vertex in the array of transformed vertices
-			transformed_vertices[j] = transformed_vertex;
+	if (is_occluder) {
+		flush_geometry_jobs();
+		for (int i = first_triangle; i < array_length(geometry_frame->triangles_to_render); i++) {
+			rasterize_occluder(&geometry_frame->triangles_to_render[i]);
 		}
+	}
+}
+
+tex2_t get_vertex_uv(mesh_t* mesh, int index) {
+	return mesh->is_quantized ? dequantize_uv(&mesh->quantized, index) : mesh->uvs[index];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the faces [first_face, last_face) of a draw through the per-face
+// pipeline stages and append the resulting screen space triangles to an array.
+// The face vertices are fetched already transformed to camera space.
+///////////////////////////////////////////////////////////////////////////////
+void process_meshlet_faces(mesh_draw_t* draw, int first_face, int last_face, triangle_t** triangles) {
+	mesh_t* mesh = draw->mesh;
+	vec4_t* vertices = &view_vertices[draw->first_vertex];
+
+	for (int i = first_face; i < last_face; i++) {
+		face_t mesh_face;
+		if (draw->short_indices) {
+			mesh_face.a = draw->short_indices[i * 3 + 0];
+			mesh_face.b = draw->short_indices[i * 3 + 1];
+			mesh_face.c = draw->short_indices[i * 3 + 2];
+		}
+		else {
+			mesh_face = draw->faces[i];
+		}
+
+		vec4_t transformed_vertices[3] = {
+			vertices[mesh_face.a],
+			vertices[mesh_face.b],
+			vertices[mesh_face.c],
+		};
 
 		vec3_t face_normal = get_triangle_normal(transformed_vertices);
 
@@ -218,9 +561,9 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 			vec3_from_vec4(transformed_vertices[0]),
 			vec3_from_vec4(transformed_vertices[1]),
 			vec3_from_vec4(transformed_vertices[2]),
-			mesh_face.a_uv,
-			mesh_face.b_uv,
-			mesh_face.c_uv
+			get_vertex_uv(mesh, mesh_face.a),
+			get_vertex_uv(mesh, mesh_face.b),
+			get_vertex_uv(mesh, mesh_face.c)
 		);
 
 		// Clip the polygon and returns a new polygon with potential new vertices
@@ -243,21 +586,21 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 				projected_points[j] = mat4_mul_vec4_project(proj_matrix, triangle_after_clipping.points[j]);
 
 				// Scale into view
-				projected_points[j].x *= (get_window_width() / 2.0);
-				projected_points[j].y *= (get_window_height() / 2.0);
+				projected_points[j].x *= (geometry_frame->render_width / 2.0);
+				projected_points[j].y *= (geometry_frame->render_height / 2.0);
 
 				// Invert the y values to account for flipped screen y coordinate
 				projected_points[j].y *= -1;
 
 				// Translate projected point to the middle of the screen
-				projected_points[j].x += (get_window_width() / 2.0);
-				projected_points[j].y += (get_window_height() / 2.0);
+				projected_points[j].x += (geometry_frame->render_width / 2.0);
+				projected_points[j].y += (geometry_frame->render_height / 2.0);
 			}
 
 			// Calculate light shading for the face
 			float light_intensity = -vec3_dot(face_normal, get_light_direction());
 
-			uint32_t face_color_lighted = light_apply_intensity(mesh_face.color, light_intensity);
+			uint32_t face_color_lighted = light_apply_intensity(mesh->color, light_intensity);
 
 			triangle_t triangle_to_render = {
 				.points = {
@@ -271,49 +614,261 @@ void process_graphics_pipeline_stages(mesh_t* mesh) {
 					{ triangle_after_clipping.texcoords[2].u, triangle_after_clipping.texcoords[2].v }
 				},
 				.color = face_color_lighted,
-				.texture = mesh->texture
+				.texture = draw->texture,
+				.object_index = draw->object_index
 			};
 
-			if (num_triangles_to_render < MAX_TRIANGLES_TO_RENDER) {
-				triangles_to_render[num_triangles_to_render++] = triangle_to_render;
-			}
+			array_push(*triangles, triangle_to_render);
 		}
 	}
 }
 
-void update(void) {
-	int time_to_wait = FRAME_TARGET_TIME - (SDL_GetTicks() - previous_frame_time);
-	if (time_to_wait > 0 && time_to_wait <= FRAME_TARGET_TIME) {
-		SDL_Delay(time_to_wait);
+///////////////////////////////////////////////////////////////////////////////
+// Compare everything the image depends on (view, resolution, render and cull
+// settings, object transforms) with the previous frame. The values are
+// collected into a flat array, the global ones first and then
+// OBJECT_STATE_VALUES per object, so the frame can tell which objects moved.
+///////////////////////////////////////////////////////////////////////////////
+bool has_scene_changed(frame_t* frame) {
+	float* state = previous_scene_state;
+	array_clear(state);
+
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			array_push(state, frame->view_matrix.m[i][j]);
+		}
+	}
+	array_push(state, (float)frame->render_width);
+	array_push(state, (float)frame->render_height);
+	array_push(state, (float)should_render_wire_vertex());
+	array_push(state, (float)should_render_wireframe());
+	array_push(state, (float)should_render_filled_triangle());
+	array_push(state, (float)should_render_textured_triangle());
+	array_push(state, (float)is_cull_backface());
+	array_push(state, (float)is_occlusion_culling());
+	int num_global_values = array_length(state);
+
+	for (int i = 0; i < get_num_objects(); i++) {
+		object_t* object = get_object(i);
+		vec3_t transform[3] = { object->scale, object->rotation, object->translation };
+		for (int j = 0; j < 3; j++) {
+			array_push(state, transform[j].x);
+			array_push(state, transform[j].y);
+			array_push(state, transform[j].z);
+		}
 	}
 
+	frame->is_full_redraw = is_redraw_needed ||
+		array_length(state) != array_length(scene_state) ||
+		memcmp(state, scene_state, sizeof(float) * num_global_values) != 0;
+
+	bool has_changed = frame->is_full_redraw;
+	array_clear(frame->is_object_changed);
+	for (int i = 0; i < get_num_objects(); i++) {
+		int offset = num_global_values + i * OBJECT_STATE_VALUES;
+		bool is_changed = frame->is_full_redraw || memcmp(&state[offset], &scene_state[offset], sizeof(float) * OBJECT_STATE_VALUES) != 0;
+		array_push(frame->is_object_changed, is_changed);
+		has_changed = has_changed || is_changed;
+	}
+
+	previous_scene_state = scene_state;
+	scene_state = state;
+	is_redraw_needed = false;
+	return has_changed;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Advance the scene by one fixed simulation step
+///////////////////////////////////////////////////////////////////////////////
+void simulate(float step) {
+	// Nothing moves on its own yet: objects only change through the scene
+	// description, this is where animation will advance by step seconds
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for the frame time, run the simulation steps that are due and snapshot
+// the camera into the frame to transform
+///////////////////////////////////////////////////////////////////////////////
+void begin_frame(frame_t* frame) {
 	// Get a delta time factor converted to seconds to be used to update our game objects
-	delta_time = (SDL_GetTicks() - previous_frame_time) / 1000.0;
+	delta_time = wait_for_next_frame();
 
-	previous_frame_time = SDL_GetTicks();
+	// The geometry thread is idle here, so the scene can be changed safely
+	simulation_time_left += delta_time;
+	int num_steps = 0;
+	while (simulation_time_left >= SIMULATION_STEP && num_steps < SIMULATION_MAX_STEPS) {
+		simulate(SIMULATION_STEP);
+		simulation_time_left -= SIMULATION_STEP;
+		num_steps++;
+	}
+
+	// Drop the time that couldn't be simulated instead of falling further behind
+	if (num_steps == SIMULATION_MAX_STEPS) {
+		simulation_time_left = 0;
+	}
+
+	// Update camera look at target to create view matrix
+	vec3_t target = get_camera_lookat_target();
+	vec3_t up_direction = vec3_new(0, 1, 0);
+	frame->view_matrix = mat4_look_at(get_camera_position(), target, up_direction);
+	frame->camera_position = get_camera_position();
 
-	num_triangles_to_render = 0;
+	// Resolution picked by the controller from the raster time of the previous frames
+	frame->render_width = (int)(get_window_width() * get_resolution_scale() + 0.5);
+	frame->render_height = (int)(get_window_height() * get_resolution_scale() + 0.5);
 
-	for (int i = 0; i < get_num_meshes(); i++) {
-		mesh_t* mesh = get_mesh(i);
-		//mesh.rotation.x += 0.6 * delta_time;
-		//mesh.rotation.y += 0.6 * delta_time;
-		//mesh.rotation.z += 0.6 * delta_time;
-		//mesh.translation.z = 5;
+	// Objects behind the occluders only disappear when the triangles in front are filled
+	frame->is_occlusion_culling = is_occlusion_culling() && (should_render_filled_triangle() || should_render_textured_triangle());
+}
+
+typedef struct {
+	int index;
+	float distance;
+} object_order_t;
 
-		// Process the graphics pipeline stages for every mesh of our 3D scene
-		process_graphics_pipeline_stages(mesh);
+int compare_object_order(const void* a, const void* b) {
+	const object_order_t* order_a = (const object_order_t*)a;
+	const object_order_t* order_b = (const object_order_t*)b;
+	if (order_a->distance != order_b->distance) {
+		return order_a->distance < order_b->distance ? -1 : 1;
 	}
+	return (order_a->index > order_b->index) - (order_a->index < order_b->index);
 }
 
-void render(void) {
+void update(frame_t* frame) {
+	geometry_frame = frame;
+	array_clear(geometry_frame->triangles_to_render);
+
+	view_matrix = frame->view_matrix;
+
+	set_occlusion_viewport(frame->render_width, frame->render_height);
+	clear_occlusion_buffer();
+
+	// Visit the objects front to back, so near objects occlude the ones behind them
+	int num_objects = get_num_objects();
+	object_order_t* object_order = (object_order_t*)malloc(sizeof(object_order_t) * (num_objects + 1));
+	for (int i = 0; i < num_objects; i++) {
+		object_order[i].index = i;
+		object_order[i].distance = vec3_length(vec3_sub(get_object(i)->translation, frame->camera_position));
+	}
+	qsort(object_order, num_objects, sizeof(object_order_t), compare_object_order);
+
+	for (int i = 0; i < num_objects; i++) {
+		// Process the graphics pipeline stages for every object of our 3D scene
+		process_graphics_pipeline_stages(object_order[i].index);
+	}
+
+	// Transform whatever is still queued
+	flush_geometry_jobs();
+
+	free(object_order);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Geometry thread: run the update stage every time a frame is handed over
+///////////////////////////////////////////////////////////////////////////////
+int geometry_thread_main(void* data) {
+	while (true) {
+		SDL_SemWait(geometry_start);
+		if (is_geometry_quitting) {
+			return 0;
+		}
+		update(geometry_frame);
+		SDL_SemPost(geometry_done);
+	}
+}
+
+bool start_geometry_thread(void) {
+	geometry_start = SDL_CreateSemaphore(0);
+	geometry_done = SDL_CreateSemaphore(0);
+	if (!geometry_start || !geometry_done) {
+		fprintf(stderr, "Error creating the geometry thread semaphores: %s\n", SDL_GetError());
+		return false;
+	}
+
+	geometry_thread = SDL_CreateThread(geometry_thread_main, "geometry", NULL);
+	if (!geometry_thread) {
+		fprintf(stderr, "Error creating the geometry thread: %s\n", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+void stop_geometry_thread(void) {
+	if (geometry_thread) {
+		is_geometry_quitting = true;
+		SDL_SemPost(geometry_start);
+		SDL_WaitThread(geometry_thread, NULL);
+	}
+	SDL_DestroySemaphore(geometry_start);
+	SDL_DestroySemaphore(geometry_done);
+}
+
+screen_rect_t get_triangle_screen_rect(triangle_t* triangle) {
+	float min_x = fminf(triangle->points[0].x, fminf(triangle->points[1].x, triangle->points[2].x));
+	float min_y = fminf(triangle->points[0].y, fminf(triangle->points[1].y, triangle->points[2].y));
+	float max_x = fmaxf(triangle->points[0].x, fmaxf(triangle->points[1].x, triangle->points[2].x));
+	float max_y = fmaxf(triangle->points[0].y, fmaxf(triangle->points[1].y, triangle->points[2].y));
+
+	screen_rect_t rect = {
+		(int)floorf(min_x) - DIRTY_RECT_MARGIN,
+		(int)floorf(min_y) - DIRTY_RECT_MARGIN,
+		(int)ceilf(max_x) + DIRTY_RECT_MARGIN + 1,
+		(int)ceilf(max_y) + DIRTY_RECT_MARGIN + 1
+	};
+	return rect;
+}
+
+void render(frame_t* frame) {
+	uint64_t start_time = get_time_ns();
+
+	set_render_resolution(frame->render_width, frame->render_height);
+
+	// Screen bounds of every object in this frame
+	int num_triangles = array_length(frame->triangles_to_render);
+	screen_rect_t* bounds = previous_object_bounds;
+	array_clear(bounds);
+	for (int i = 0; i < get_num_objects(); i++) {
+		screen_rect_t empty = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+		array_push(bounds, empty);
+	}
+	for (int i = 0; i < num_triangles; i++) {
+		screen_rect_t rect = get_triangle_screen_rect(&frame->triangles_to_render[i]);
+		screen_rect_t* object_rect = &bounds[frame->triangles_to_render[i].object_index];
+		object_rect->x0 = rect.x0 < object_rect->x0 ? rect.x0 : object_rect->x0;
+		object_rect->y0 = rect.y0 < object_rect->y0 ? rect.y0 : object_rect->y0;
+		object_rect->x1 = rect.x1 > object_rect->x1 ? rect.x1 : object_rect->x1;
+		object_rect->y1 = rect.y1 > object_rect->y1 ? rect.y1 : object_rect->y1;
+	}
+
+	// Redraw where the objects that moved were and where they are now
+	bool is_full_redraw = !is_dirty_rendering || frame->is_full_redraw || array_length(object_bounds) != array_length(bounds);
+	begin_dirty_region(is_full_redraw);
+	if (!is_full_redraw) {
+		for (int i = 0; i < array_length(bounds); i++) {
+			if (frame->is_object_changed[i]) {
+				add_dirty_rect(object_bounds[i].x0, object_bounds[i].y0, object_bounds[i].x1, object_bounds[i].y1);
+				add_dirty_rect(bounds[i].x0, bounds[i].y0, bounds[i].x1, bounds[i].y1);
+			}
+		}
+	}
+	end_dirty_region();
+	previous_object_bounds = object_bounds;
+	object_bounds = bounds;
+
 	clear_color_buffer(0xFF000000);
 	clear_z_buffer();
 
 	draw_grid();
 
-	for (int i = 0; i < num_triangles_to_render; i++) {
-		triangle_t triangle = triangles_to_render[i];
+	for (int i = 0; i < num_triangles; i++) {
+		triangle_t triangle = frame->triangles_to_render[i];
+
+		// Triangles outside the redrawn region are already in the buffer
+		screen_rect_t rect = get_triangle_screen_rect(&triangle);
+		if (!is_rect_dirty(rect.x0, rect.y0, rect.x1, rect.y1)) {
+			continue;
+		}
 
 		if (should_render_filled_triangle()) {
 			// Draw filled triangle
@@ -354,27 +909,195 @@ void render(void) {
 		}
 	}
 
+	// Feed the raster time (without waiting for a free buffer) to the resolution controller
+	float raster_time = (get_time_ns() - start_time) / 1000000.0;
+	update_resolution_scaling(raster_time);
+
 	render_color_buffer();
 }
 
 void free_resources(void)
 {
+	destroy_job_system();
+	for (int i = 0; i < MAX_JOB_THREADS; i++) {
+		array_free(thread_triangles[i]);
+	}
+	array_free(geometry_jobs);
+	array_free(vertex_jobs);
+	array_free(view_vertices);
+	array_free(face_ranges);
+	array_free(mesh_draws);
+	array_free(scene_state);
+	array_free(previous_scene_state);
+	array_free(object_bounds);
+	array_free(previous_object_bounds);
+	for (int i = 0; i < 2; i++) {
+		array_free(frames[i].is_object_changed);
+		array_free(frames[i].triangles_to_render);
+	}
+	free_scene();
 	free_meshes();
+	free_textures();
 	destroy_window();
+
+	// The display no longer presents, flush the frames still queued
+	close_frame_sink();
+}
+
+void print_usage(void) {
+	fprintf(stderr,
+		"Usage: 3drenderer [options]\n"
+		"  --scene FILE      scene to load (defaults to ./assets/default.scene)\n"
+		"  --headless        render offscreen, without a window\n"
+		"  --size WxH        internal resolution (defaults to a third of the screen)\n"
+		"  --frames N        quit after N frames and print the average frame time\n"
+		"  --uncapped        render as fast as possible, even when nothing changes (benchmarks)\n"
+		"  --capture FILE    stream the frames to FILE (.y4m video or PPM sequence, - for stdout)\n"
+		"  --dirty-rects     only redraw the regions of the objects that moved (disables zero-copy)\n"
+		"  --quantize        keep the meshes in 16-bit quantized form (less memory, small precision loss)\n"
+		"  --dynamic-resolution MIN:MAX\n"
+		"                    scale the resolution between MIN and MAX (0-1) to hold the frame rate\n"
+	);
+}
+
+bool parse_arguments(int argc, char* args[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(args[i], "--headless") == 0) {
+			set_display_backend(DISPLAY_OFFSCREEN);
+		}
+		else if (strcmp(args[i], "--scene") == 0 && i + 1 < argc) {
+			scene_path = args[++i];
+		}
+		else if (strcmp(args[i], "--size") == 0 && i + 1 < argc) {
+			char* end = NULL;
+			int width = (int)strtol(args[++i], &end, 10);
+			int height = (*end == 'x') ? (int)strtol(end + 1, &end, 10) : 0;
+			if (width <= 0 || height <= 0 || *end != '\0') {
+				fprintf(stderr, "Invalid size: %s\n", args[i]);
+				return false;
+			}
+			set_display_resolution(width, height);
+		}
+		else if (strcmp(args[i], "--frames") == 0 && i + 1 < argc) {
+			max_frames = atoi(args[++i]);
+		}
+		else if (strcmp(args[i], "--uncapped") == 0) {
+			is_frame_rate_capped = false;
+		}
+		else if (strcmp(args[i], "--capture") == 0 && i + 1 < argc) {
+			capture_path = args[++i];
+		}
+		else if (strcmp(args[i], "--dirty-rects") == 0) {
+			is_dirty_rendering = true;
+		}
+		else if (strcmp(args[i], "--quantize") == 0) {
+			is_quantized_storage = true;
+		}
+		else if (strcmp(args[i], "--dynamic-resolution") == 0 && i + 1 < argc) {
+			char* end = NULL;
+			min_resolution_scale = strtof(args[++i], &end);
+			max_resolution_scale = (*end == ':') ? strtof(end + 1, &end) : 0;
+			if (min_resolution_scale <= 0 || max_resolution_scale > 1 || min_resolution_scale > max_resolution_scale || *end != '\0') {
+				fprintf(stderr, "Invalid resolution scale range: %s\n", args[i]);
+				return false;
+			}
+		}
+		else {
+			fprintf(stderr, "Unknown argument: %s\n", args[i]);
+			print_usage();
+			return false;
+		}
+	}
+	return true;
 }
 
 int main(int argc, char* args[]) {
-	
+	if (!parse_arguments(argc, args)) {
+		return 1;
+	}
+
+	// Rasterize straight into the locked streaming textures, unless the previous
+	// frames have to be kept in the buffers for dirty rectangles or the frames are
+	// captured (locked texture memory is write-only, the capture has to read it)
+	set_zero_copy_rendering(!is_dirty_rendering && capture_path == NULL);
+
 	is_running = initialize_window();
 
+	init_resolution_scaling(min_resolution_scale, max_resolution_scale);
+	init_frame_pacer(is_frame_rate_capped ? FPS : 0);
+
+	// Benchmarks and captures need every frame to be rendered
+	is_idle_skipping = is_frame_rate_capped && max_frames == 0 && capture_path == NULL;
+
 	setup();
 
+	if (is_running && capture_path) {
+		// The sink copies every presented frame and writes it from its own thread
+		is_running = open_frame_sink(capture_path, get_window_width(), get_window_height(), FPS);
+		set_present_callback(submit_frame_sink);
+	}
+
+	if (is_running) {
+		is_running = start_geometry_thread();
+	}
+
+	int frame_index = 0;
+	bool has_previous_frame = false;
+	int num_frames_rendered = 0;
+	uint64_t start_time = get_time_ns();
+
 	while (is_running) {
 		process_input();
-		update();
-		render();
+
+		frame_t* frame = &frames[frame_index];
+		begin_frame(frame);
+
+		bool has_changed = has_scene_changed(frame);
+		if (is_idle_skipping && !has_changed) {
+			// Finish the frame still in flight, the window keeps showing it
+			if (has_previous_frame) {
+				render(&frames[frame_index ^ 1]);
+				num_frames_rendered++;
+				has_previous_frame = false;
+			}
+
+			// Sleep past the next frame deadline unless an event arrives first (it stays queued)
+			SDL_WaitEventTimeout(NULL, get_time_to_next_frame());
+			continue;
+		}
+
+		// Hand the frame over to the geometry thread (the semaphore publishes the snapshot)
+		geometry_frame = frame;
+		SDL_SemPost(geometry_start);
+
+		if (FRAME_LATENCY == 0) {
+			SDL_SemWait(geometry_done);
+			render(frame);
+			num_frames_rendered++;
+		}
+		else {
+			// Rasterize the previous frame while the geometry of this one is processed
+			if (has_previous_frame) {
+				render(&frames[frame_index ^ 1]);
+				num_frames_rendered++;
+			}
+			SDL_SemWait(geometry_done);
+			has_previous_frame = true;
+		}
+
+		frame_index ^= 1;
+
+		if (max_frames > 0 && num_frames_rendered >= max_frames) {
+			is_running = false;
+		}
+	}
+
+	if (max_frames > 0 && num_frames_rendered > 0) {
+		double milliseconds = (get_time_ns() - start_time) / 1000000.0;
+		fprintf(stderr, "%d frames, %.3f ms/frame\n", num_frames_rendered, milliseconds / num_frames_rendered);
 	}
 
+	stop_geometry_thread();
 	free_resources();
 
 	return 0;
@@ -3,113 +3,169 @@
 #include <string.h>
 #include "mesh.h"
 #include "array.h"
+#include "lod.h"
+#include "vertex_cache.h"
+#include "file_map.h"
+#include "obj_parser.h"
+#include "mesh_cache.h"
+
+// The store holds pointers, so the meshes stay in place as it grows
+static mesh_t** meshes = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Load the OBJ file and build everything the renderer needs from it
+///////////////////////////////////////////////////////////////////////////////
+static void process_mesh_obj_data(mesh_t* mesh, const char* obj_filename) {
+	load_mesh_obj_data(mesh, obj_filename);
+
+	get_bounding_sphere(
+		mesh->vertices,
+		array_length(mesh->vertices),
+		&mesh->bounds_center,
+		&mesh->bounds_radius
+	);
+
+	float acmr_before = get_average_cache_miss_ratio(
+		mesh->faces,
+		array_length(mesh->faces),
+		array_length(mesh->vertices)
+	);
+
+	// Build the simplified levels and split every level into clusters that can be culled as a whole
+	build_mesh_lods(mesh);
+
+	// Reorder faces and vertices for cache locality, keeping the meshlet ranges intact
+	optimize_mesh(mesh);
+
+	float acmr_after = get_average_cache_miss_ratio(
+		mesh->faces,
+		array_length(mesh->faces),
+		array_length(mesh->vertices)
+	);
+	fprintf(stderr, "%s: ACMR %.3f -> %.3f\n", obj_filename, acmr_before, acmr_after);
+}
 
-#define MAXIMUM_NUM_MESHES 10
-#define STRING_MAX_LENGTH 512
-
-static mesh_t meshes[MAXIMUM_NUM_MESHES];
-static int mesh_count = 0;
-
-void load_mesh(const char* obj_filename, const char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation)
+///////////////////////////////////////////////////////////////////////////////
+// Return the mesh of an OBJ file, loading it the first time it is asked for
+///////////////////////////////////////////////////////////////////////////////
+mesh_t* load_mesh(const char* obj_filename)
 {
-	load_mesh_obj_data(&meshes[mesh_count], obj_filename);
-	load_mesh_png_data(&meshes[mesh_count], png_filename);
+	for (int i = 0; i < array_length(meshes); i++) {
+		if (strcmp(meshes[i]->filename, obj_filename) == 0) {
+			return meshes[i];
+		}
+	}
+
+	mesh_t* mesh = (mesh_t*)calloc(1, sizeof(mesh_t));
+	snprintf(mesh->filename, sizeof(mesh->filename), "%s", obj_filename);
 
-	meshes[mesh_count].scale = scale;
-	meshes[mesh_count].translation = translation;
-	meshes[mesh_count].rotation = rotation;
+	// The cache holds the mesh as process_mesh_obj_data leaves it
+	if (!load_mesh_cache(mesh, obj_filename)) {
+		process_mesh_obj_data(mesh, obj_filename);
+		save_mesh_cache(mesh, obj_filename);
+	}
+	mesh->color = 0xFFFFFFFF;
 
-	mesh_count++;
+	array_push(meshes, mesh);
+	return mesh;
 }
 
 void load_mesh_obj_data(mesh_t* mesh, const char* obj_filename) {
-	char line[STRING_MAX_LENGTH];
-	char* token = NULL;
-	char space_delim[2] = " ";
-
-	FILE* file = NULL;
-	if (fopen_s(&file, obj_filename, "r") != 0) {
+	file_map_t map;
+	if (!map_file(&map, obj_filename)) {
 		return;
 	}
 
-	tex2_t* tex_coords = NULL;
+	parse_obj(map.data, map.size, &mesh->vertices, &mesh->uvs, &mesh->faces);
 
-	while (fgets(line, STRING_MAX_LENGTH, file)) {
-		// Vertex information
-		if (strncmp(line, "v ", 2) == 0) {
-			vec3_t vertex;
-			sscanf_s(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-			array_push(mesh->vertices, vertex);
-		}
+	unmap_file(&map);
+}
 
-		// Texture coordinate information
-		if (strncmp(line, "vt ", 3) == 0) {
-			tex2_t tex_coord;
-			sscanf_s(line, "vt %f %f", &tex_coord.u, &tex_coord.v);
-			// Flip the V component to account for inverted UV-coordinates (V grows downwards)
-			tex_coord.v = 1 - tex_coord.v;
-			array_push(tex_coords, tex_coord);
-		}
+///////////////////////////////////////////////////////////////////////////////
+// Switch the mesh to the compact storage: 16-bit positions and texture
+// coordinates, and 16-bit indices when the vertex count allows. The float
+// arrays are released, unless they belong to the cache mapping.
+///////////////////////////////////////////////////////////////////////////////
+void quantize_mesh(mesh_t* mesh) {
+	int num_vertices = array_length(mesh->vertices);
+	if (mesh->is_quantized) {
+		return;
+	}
 
-		// Face information
-		if (strncmp(line, "f ", 2) == 0) {
-			int vertex_indices[3];
-			int texture_indices[3];
-			int normal_indices[3];
-			sscanf_s(
-				line, "f %d/%d/%d %d/%d/%d %d/%d/%d", 
-				&vertex_indices[0], &texture_indices[0], &normal_indices[0],
-				&vertex_indices[1], &texture_indices[1], &normal_indices[1],
-				&vertex_indices[2], &texture_indices[2], &normal_indices[2]
-			);
-			face_t face = {
-				.a = vertex_indices[0] - 1,
-				.b = vertex_indices[1] - 1,
-				.c = vertex_indices[2] - 1,
-				.a_uv = tex_coords[texture_indices[0] - 1],
-				.b_uv = tex_coords[texture_indices[1] - 1],
-				.c_uv = tex_coords[texture_indices[2] - 1],
-				.color = 0xFFFFFFFF
-			};
-			array_push(mesh->faces, face);
+	quantize_vertices(&mesh->quantized, mesh->vertices, mesh->uvs, num_vertices);
+	mesh->is_quantized = true;
+
+	bool is_cached = mesh->cache_map.data != NULL;
+	if (num_vertices <= QUANTIZE_MAX_SHORT_INDEX_VERTICES) {
+		for (int l = 0; l < mesh->num_lods; l++) {
+			mesh_lod_t* lod = &mesh->lods[l];
+			lod->short_indices = (uint16_t*)malloc(sizeof(uint16_t) * (lod->num_faces * 3 + 1));
+			for (int i = 0; i < lod->num_faces; i++) {
+				lod->short_indices[i * 3 + 0] = (uint16_t)lod->faces[i].a;
+				lod->short_indices[i * 3 + 1] = (uint16_t)lod->faces[i].b;
+				lod->short_indices[i * 3 + 2] = (uint16_t)lod->faces[i].c;
+			}
+			if (!is_cached) {
+				array_free(lod->faces);
+			}
+			lod->faces = NULL;
 		}
+		mesh->faces = NULL;
 	}
 
-	array_free(tex_coords);
-}
-
-void load_mesh_png_data(mesh_t* mesh, const char* png_filename)
-{
-	upng_t* png_image = upng_new_from_file(png_filename);
-	if (png_image != NULL) {
-		upng_decode(png_image);
-		if (upng_get_error(png_image) == UPNG_EOK)
-		{
-			mesh->texture = png_image;
-		}
+	if (!is_cached) {
+		array_free(mesh->vertices);
+		array_free(mesh->uvs);
 	}
+	mesh->vertices = NULL;
+	mesh->uvs = NULL;
 }
 
 int get_num_meshes()
 {
-	return mesh_count;
+	return array_length(meshes);
 }
 
 mesh_t* get_mesh(int index) {
-	if (index >= MAXIMUM_NUM_MESHES)
+	if (index < 0 || index >= array_length(meshes))
 	{
 		return NULL;
 	}
 
-	return &meshes[index];
+	return meshes[index];
 }
 
 void free_meshes(void) 
 {
-	for (int i = 0; i < mesh_count; i++)
+	for (int i = 0; i < array_length(meshes); i++)
 	{
-		upng_free(meshes[i].texture);
-		array_free(meshes[i].faces);
-		array_free(meshes[i].vertices);
+		mesh_t* mesh = meshes[i];
+
+		if (mesh->is_quantized) {
+			free_quantized_vertices(&mesh->quantized);
+			for (int j = 0; j < mesh->num_lods; j++) {
+				free(mesh->lods[j].short_indices);
+			}
+		}
+
+		// Cached arrays are part of the mapping
+		if (mesh->cache_map.data) {
+			unmap_file(&mesh->cache_map);
+		}
+		else {
+			for (int j = 0; j < mesh->num_lods; j++) {
+				array_free(mesh->lods[j].meshlets);
+				if (mesh->lods[j].faces != mesh->faces) {
+					array_free(mesh->lods[j].faces);
+				}
+			}
+			array_free(mesh->faces);
+			array_free(mesh->uvs);
+			array_free(mesh->vertices);
+		}
+
+		free(mesh);
 	}
-}
\ No newline at end of file
+	array_free(meshes);
+	meshes = NULL;
+}
@@ -1,23 +1,52 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdio.h>
 #include "vector.h"
 #include "triangle.h"
+#include "meshlet.h"
 #include "upng.h"
+#include "file_map.h"
+#include "quantize.h"
+
+#define MAX_NUM_LODS 4
+
+// A level of detail: faces indexing the mesh vertices, split into meshlets.
+// The vertices are ordered so every level only uses the first num_vertices.
+// Quantized meshes with few enough vertices replace the faces with 16-bit
+// indices (3 per face).
+typedef struct {
+	face_t* faces;
+	uint16_t* short_indices;
+	meshlet_t* meshlets;
+	int num_faces;
+	int num_vertices;
+} mesh_lod_t;
 
 // Define a struct for dynamic size meshes, with array of vertices and faces;
+// lods[0] uses the authored faces, the following levels are simplified copies.
+// Vertices are welded (position, texture coordinate) pairs stored in two
+// parallel arrays, so the faces only hold indices. Quantized meshes keep them
+// in the compact 16-bit form instead. A mesh is loaded once per OBJ file and
+// shared by all the scene objects placing it.
 typedef struct {
+	char filename[FILENAME_MAX];
 	vec3_t* vertices;
+	tex2_t* uvs;
+	quantized_vertices_t quantized;
+	bool is_quantized;
 	face_t* faces;
-	upng_t* texture;
-	vec3_t rotation;
-	vec3_t scale;
-	vec3_t translation;
+	uint32_t color;
+	mesh_lod_t lods[MAX_NUM_LODS];
+	int num_lods;
+	vec3_t bounds_center;
+	float bounds_radius;
+	file_map_t cache_map; // the arrays point into this read-only mapping when loaded from the cache
 } mesh_t;
 
-void load_mesh(const char* obj_filename, const char* png_filename, vec3_t scale, vec3_t translation, vec3_t rotation);
+mesh_t* load_mesh(const char* obj_filename);
 void load_mesh_obj_data(mesh_t* mesh, const char* obj_filename);
-void load_mesh_png_data(mesh_t* mesh, const char* png_filename);
+void quantize_mesh(mesh_t* mesh);
 
 int get_num_meshes();
 mesh_t* get_mesh(int index);
@@ -0,0 +1,253 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mesh_cache.h"
+#include "array.h"
+#include "file_map.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Binary mesh cache: the processed mesh (vertices with their texture
+// coordinates, and the faces and meshlets of every level of detail) is written next to the OBJ the first time it is
+// loaded. Later loads map the cache file and point the mesh arrays straight
+// into the mapping, skipping the parsing, simplification and reordering.
+// The file is only meant for the machine that wrote it (native byte order
+// and struct layout, checked through the item sizes).
+///////////////////////////////////////////////////////////////////////////////
+#define ARRAY_HEADER_SIZE (2 * sizeof(int))
+
+static void get_cache_filename(char* cache_filename, size_t size, const char* obj_filename) {
+	snprintf(cache_filename, size, "%s%s", obj_filename, MESH_CACHE_EXTENSION);
+}
+
+static FILE* open_file(const char* filename, const char* mode) {
+	FILE* file = NULL;
+#ifdef _WIN32
+	fopen_s(&file, filename, mode);
+#else
+	file = fopen(filename, mode);
+#endif
+	return file;
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_bytes(const char* data, size_t size) {
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (uint8_t)data[i];
+		hash *= 0x100000001B3ull;
+	}
+	return hash;
+}
+
+static bool hash_file(const char* filename, uint64_t* hash) {
+	file_map_t map;
+	if (!map_file(&map, filename)) {
+		return false;
+	}
+	*hash = hash_bytes(map.data, map.size);
+	unmap_file(&map);
+	return true;
+}
+
+// Failing to update it only means hashing the source again next time
+static void update_source_mtime(const char* cache_filename, int64_t source_mtime) {
+	FILE* file = open_file(cache_filename, "r+b");
+	if (!file) {
+		return;
+	}
+	if (fseek(file, (long)offsetof(mesh_cache_header_t, source_mtime), SEEK_SET) == 0) {
+		fwrite(&source_mtime, sizeof(source_mtime), 1, file);
+	}
+	fclose(file);
+}
+
+static void* get_section(file_map_t* map, mesh_cache_section_t* section, size_t item_size) {
+	if (section->item_size != item_size ||
+		section->offset % MESH_CACHE_ALIGNMENT != 0 ||
+		section->offset < ARRAY_HEADER_SIZE ||
+		section->offset > map->size ||
+		(uint64_t)section->count * item_size > map->size - section->offset) {
+		return NULL;
+	}
+
+	// The array header written before the data has to agree with the section
+	const int* array_header = (const int*)(map->data + section->offset - ARRAY_HEADER_SIZE);
+	if (array_header[0] != (int)section->count || array_header[1] != (int)section->count) {
+		return NULL;
+	}
+	return (void*)(map->data + section->offset);
+}
+
+// The geometry stage trusts the indices, so a damaged or stale cache must not
+// point past the vertices of its level of detail or past its faces
+static bool are_faces_valid(const face_t* faces, int num_faces, int num_vertices) {
+	for (int i = 0; i < num_faces; i++) {
+		if (faces[i].a < 0 || faces[i].a >= num_vertices ||
+			faces[i].b < 0 || faces[i].b >= num_vertices ||
+			faces[i].c < 0 || faces[i].c >= num_vertices) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool are_meshlets_valid(const meshlet_t* meshlets, int num_meshlets, int num_faces) {
+	for (int i = 0; i < num_meshlets; i++) {
+		if (meshlets[i].first_face < 0 || meshlets[i].num_faces < 0 ||
+			meshlets[i].first_face > num_faces - meshlets[i].num_faces) {
+			return false;
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Point the mesh at the cached arrays, false if there's no cache or it doesn't
+// match the OBJ file anymore. The arrays are read-only and stay mapped until
+// the mesh is freed.
+///////////////////////////////////////////////////////////////////////////////
+bool load_mesh_cache(mesh_t* mesh, const char* obj_filename) {
+	char cache_filename[1024];
+	get_cache_filename(cache_filename, sizeof(cache_filename), obj_filename);
+
+	int64_t source_mtime;
+	uint64_t source_size;
+	int64_t cache_mtime;
+	uint64_t cache_size;
+	if (!get_file_info(obj_filename, &source_mtime, &source_size) ||
+		!get_file_info(cache_filename, &cache_mtime, &cache_size) ||
+		cache_size < sizeof(mesh_cache_header_t)) {
+		return false;
+	}
+
+	// The header is checked (and refreshed) before the file gets mapped
+	mesh_cache_header_t header;
+	FILE* file = open_file(cache_filename, "rb");
+	if (!file) {
+		return false;
+	}
+	bool is_valid = fread(&header, sizeof(header), 1, file) == 1;
+	fclose(file);
+	is_valid = is_valid &&
+		header.magic == MESH_CACHE_MAGIC &&
+		header.version == MESH_CACHE_VERSION &&
+		header.source_size == source_size &&
+		header.num_lods >= 1 && header.num_lods <= MAX_NUM_LODS;
+
+	// Only hash the source when the time stamp alone can't tell. When the content
+	// still matches, the new time stamp is stored so the next start doesn't hash again.
+	uint64_t source_hash;
+	if (is_valid && header.source_mtime != source_mtime) {
+		is_valid = hash_file(obj_filename, &source_hash) && source_hash == header.source_hash;
+		if (is_valid) {
+			update_source_mtime(cache_filename, source_mtime);
+		}
+	}
+	if (!is_valid) {
+		return false;
+	}
+
+	file_map_t map;
+	if (!map_file(&map, cache_filename)) {
+		return false;
+	}
+
+	mesh_t cached = { 0 };
+	cached.vertices = (vec3_t*)get_section(&map, &header.vertices, sizeof(vec3_t));
+	cached.uvs = (tex2_t*)get_section(&map, &header.uvs, sizeof(tex2_t));
+	is_valid = cached.vertices != NULL && cached.uvs != NULL && header.uvs.count == header.vertices.count;
+	for (int i = 0; i < header.num_lods && is_valid; i++) {
+		cached.lods[i].faces = (face_t*)get_section(&map, &header.lod_faces[i], sizeof(face_t));
+		cached.lods[i].meshlets = (meshlet_t*)get_section(&map, &header.lod_meshlets[i], sizeof(meshlet_t));
+		cached.lods[i].num_faces = (int)header.lod_faces[i].count;
+		cached.lods[i].num_vertices = header.lod_num_vertices[i];
+		is_valid = cached.lods[i].faces != NULL && cached.lods[i].meshlets != NULL &&
+			cached.lods[i].num_vertices >= 0 && (uint32_t)cached.lods[i].num_vertices <= header.vertices.count &&
+			cached.lods[i].num_faces >= 0 &&
+			are_faces_valid(cached.lods[i].faces, cached.lods[i].num_faces, cached.lods[i].num_vertices) &&
+			are_meshlets_valid(cached.lods[i].meshlets, (int)header.lod_meshlets[i].count, cached.lods[i].num_faces);
+	}
+
+	if (!is_valid) {
+		unmap_file(&map);
+		return false;
+	}
+
+	mesh->vertices = cached.vertices;
+	mesh->uvs = cached.uvs;
+	mesh->faces = cached.lods[0].faces;
+	for (int i = 0; i < header.num_lods; i++) {
+		mesh->lods[i] = cached.lods[i];
+	}
+	mesh->num_lods = header.num_lods;
+	mesh->bounds_center = header.bounds_center;
+	mesh->bounds_radius = header.bounds_radius;
+	mesh->cache_map = map;
+	return true;
+}
+
+static bool write_section(FILE* file, uint64_t* offset, mesh_cache_section_t* section, const void* data, int count, size_t item_size) {
+	// Leave room for the array header and align the data
+	uint64_t data_offset = (*offset + ARRAY_HEADER_SIZE + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+	static const char padding[MESH_CACHE_ALIGNMENT + ARRAY_HEADER_SIZE] = { 0 };
+	int array_header[2] = { count, count };
+
+	section->offset = data_offset;
+	section->count = (uint32_t)count;
+	section->item_size = (uint32_t)item_size;
+
+	size_t padding_size = (size_t)(data_offset - ARRAY_HEADER_SIZE - *offset);
+	bool is_written =
+		fwrite(padding, 1, padding_size, file) == padding_size &&
+		fwrite(array_header, sizeof(array_header), 1, file) == 1 &&
+		(count == 0 || fwrite(data, item_size, count, file) == (size_t)count);
+
+	*offset = data_offset + (uint64_t)count * item_size;
+	return is_written;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Write the processed mesh next to its OBJ file. Failing to write it (a
+// read-only asset folder, say) only costs the next start the full load.
+///////////////////////////////////////////////////////////////////////////////
+void save_mesh_cache(mesh_t* mesh, const char* obj_filename) {
+	char cache_filename[1024];
+	get_cache_filename(cache_filename, sizeof(cache_filename), obj_filename);
+
+	mesh_cache_header_t header = { 0 };
+	header.magic = MESH_CACHE_MAGIC;
+	header.version = MESH_CACHE_VERSION;
+	header.bounds_center = mesh->bounds_center;
+	header.bounds_radius = mesh->bounds_radius;
+	header.num_lods = mesh->num_lods;
+	for (int i = 0; i < mesh->num_lods; i++) {
+		header.lod_num_vertices[i] = mesh->lods[i].num_vertices;
+	}
+	if (!get_file_info(obj_filename, &header.source_mtime, &header.source_size) ||
+		!hash_file(obj_filename, &header.source_hash)) {
+		return;
+	}
+
+	FILE* file = open_file(cache_filename, "wb");
+	if (!file) {
+		return;
+	}
+
+	// The header goes first with empty sections and is rewritten at the end
+	uint64_t offset = sizeof(header);
+	bool is_written = fwrite(&header, sizeof(header), 1, file) == 1;
+	is_written = is_written && write_section(file, &offset, &header.vertices, mesh->vertices, array_length(mesh->vertices), sizeof(vec3_t));
+	is_written = is_written && write_section(file, &offset, &header.uvs, mesh->uvs, array_length(mesh->uvs), sizeof(tex2_t));
+	for (int i = 0; i < mesh->num_lods && is_written; i++) {
+		is_written = write_section(file, &offset, &header.lod_faces[i], mesh->lods[i].faces, array_length(mesh->lods[i].faces), sizeof(face_t));
+		is_written = is_written && write_section(file, &offset, &header.lod_meshlets[i], mesh->lods[i].meshlets, array_length(mesh->lods[i].meshlets), sizeof(meshlet_t));
+	}
+	is_written = is_written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	is_written = fclose(file) == 0 && is_written;
+
+	if (!is_written) {
+		fprintf(stderr, "Error writing the mesh cache %s\n", cache_filename);
+		remove(cache_filename);
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mesh.h"
+
+#define MESH_CACHE_MAGIC 0x4853454D // "MESH"
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_ALIGNMENT 16
+#define MESH_CACHE_EXTENSION ".meshcache"
+
+// One array in the cache file. The data starts at offset, which is aligned to
+// MESH_CACHE_ALIGNMENT, and is preceded by the array header (capacity and
+// occupied count) so array_length works on the mapped memory.
+typedef struct {
+	uint64_t offset;
+	uint32_t count;
+	uint32_t item_size;
+} mesh_cache_section_t;
+
+// The source is identified by its size and modification time; when only the
+// time differs (a fresh checkout, a touched file) the content hash decides
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_size;
+	int64_t source_mtime;
+	uint64_t source_hash;
+	vec3_t bounds_center;
+	float bounds_radius;
+	int32_t num_lods;
+	int32_t lod_num_vertices[MAX_NUM_LODS];
+	mesh_cache_section_t vertices;
+	mesh_cache_section_t uvs;
+	mesh_cache_section_t lod_faces[MAX_NUM_LODS];
+	mesh_cache_section_t lod_meshlets[MAX_NUM_LODS];
+} mesh_cache_header_t;
+
+bool load_mesh_cache(mesh_t* mesh, const char* obj_filename);
+void save_mesh_cache(mesh_t* mesh, const char* obj_filename);
+
+#endif
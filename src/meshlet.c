@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "meshlet.h"
+#include "array.h"
+#include "clipping.h"
+#include "occlusion.h"
+
+// Faces whose normal deviates more than this (cosine) from the cluster axis are
+// left for another cluster, so the clusters end up with tight normal cones
+#define MESHLET_NORMAL_THRESHOLD 0.8f
+
+static vec3_t get_face_normal(vec3_t* vertices, face_t face) {
+	// Same winding as get_triangle_normal, computed in model space
+	vec3_t vector_ab = vec3_sub(vertices[face.b], vertices[face.a]);
+	vec3_t vector_ac = vec3_sub(vertices[face.c], vertices[face.a]);
+	vec3_t normal = vec3_cross(vector_ab, vector_ac);
+
+	float length = vec3_length(normal);
+	if (length == 0) {
+		return vec3_new(0, 0, 0);
+	}
+	return vec3_div(normal, length);
+}
+
+void get_bounding_sphere(vec3_t* vertices, int num_vertices, vec3_t* center, float* radius) {
+	*center = vec3_new(0, 0, 0);
+	*radius = 0;
+	if (num_vertices == 0) {
+		return;
+	}
+
+	// Center the sphere in the middle of the axis aligned bounding box
+	vec3_t min = vertices[0];
+	vec3_t max = vertices[0];
+	for (int i = 1; i < num_vertices; i++) {
+		min.x = fminf(min.x, vertices[i].x);
+		min.y = fminf(min.y, vertices[i].y);
+		min.z = fminf(min.z, vertices[i].z);
+		max.x = fmaxf(max.x, vertices[i].x);
+		max.y = fmaxf(max.y, vertices[i].y);
+		max.z = fmaxf(max.z, vertices[i].z);
+	}
+	*center = vec3_mul(vec3_add(min, max), 0.5);
+
+	for (int i = 0; i < num_vertices; i++) {
+		*radius = fmaxf(*radius, vec3_length(vec3_sub(vertices[i], *center)));
+	}
+}
+
+static void compute_meshlet_bounds(meshlet_t* meshlet, face_t* faces, vec3_t* vertices, vec3_t* normals) {
+	vec3_t corners[MESHLET_MAX_FACES * 3];
+	int num_corners = 0;
+	vec3_t axis = vec3_new(0, 0, 0);
+
+	for (int i = meshlet->first_face; i < meshlet->first_face + meshlet->num_faces; i++) {
+		corners[num_corners++] = vertices[faces[i].a];
+		corners[num_corners++] = vertices[faces[i].b];
+		corners[num_corners++] = vertices[faces[i].c];
+		axis = vec3_add(axis, normals[i]);
+	}
+	get_bounding_sphere(corners, num_corners, &meshlet->center, &meshlet->radius);
+
+	// A cone that can't be tested is marked with a cutoff of 1 (the test never passes)
+	meshlet->cone_axis = vec3_new(0, 0, 0);
+	meshlet->cone_cutoff = 1;
+
+	float axis_length = vec3_length(axis);
+	if (axis_length == 0) {
+		return;
+	}
+	axis = vec3_div(axis, axis_length);
+
+	// The cone half-angle is given by the face normal furthest away from the axis
+	float min_dot = 1;
+	for (int i = meshlet->first_face; i < meshlet->first_face + meshlet->num_faces; i++) {
+		if (vec3_length(normals[i]) == 0) {
+			continue;
+		}
+		min_dot = fminf(min_dot, vec3_dot(normals[i], axis));
+	}
+
+	// Cones wider than a hemisphere always have a face looking at the camera
+	if (min_dot <= 0) {
+		return;
+	}
+
+	meshlet->cone_axis = axis;
+	meshlet->cone_cutoff = sqrtf(1 - min_dot * min_dot);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Split the mesh into clusters of up to MESHLET_MAX_FACES neighbouring faces.
+// Clusters are grown breadth-first over faces that share a vertex and point
+// roughly in the same direction. The face array is reordered in place
+// so every meshlet references a contiguous range of faces.
+///////////////////////////////////////////////////////////////////////////////
+meshlet_t* build_meshlets(face_t* faces, vec3_t* vertices) {
+	int num_faces = array_length(faces);
+	int num_vertices = array_length(vertices);
+	meshlet_t* meshlets = NULL;
+
+	if (num_faces == 0) {
+		return NULL;
+	}
+
+	vec3_t* normals = (vec3_t*)malloc(sizeof(vec3_t) * num_faces);
+	for (int i = 0; i < num_faces; i++) {
+		normals[i] = get_face_normal(vertices, faces[i]);
+	}
+
+	// Build the vertex to face adjacency in compressed rows
+	int* adjacency_offsets = (int*)calloc(num_vertices + 1, sizeof(int));
+	int* adjacency = (int*)malloc(sizeof(int) * num_faces * 3);
+	for (int i = 0; i < num_faces; i++) {
+		adjacency_offsets[faces[i].a + 1]++;
+		adjacency_offsets[faces[i].b + 1]++;
+		adjacency_offsets[faces[i].c + 1]++;
+	}
+	for (int i = 0; i < num_vertices; i++) {
+		adjacency_offsets[i + 1] += adjacency_offsets[i];
+	}
+	int* adjacency_fill = (int*)malloc(sizeof(int) * num_vertices);
+	memcpy(adjacency_fill, adjacency_offsets, sizeof(int) * num_vertices);
+	for (int i = 0; i < num_faces; i++) {
+		adjacency[adjacency_fill[faces[i].a]++] = i;
+		adjacency[adjacency_fill[faces[i].b]++] = i;
+		adjacency[adjacency_fill[faces[i].c]++] = i;
+	}
+	free(adjacency_fill);
+
+	int* face_order = (int*)malloc(sizeof(int) * num_faces);
+	int* face_meshlet = (int*)malloc(sizeof(int) * num_faces);
+	int* face_visit = (int*)malloc(sizeof(int) * num_faces);
+	int* queue = (int*)malloc(sizeof(int) * num_faces);
+	for (int i = 0; i < num_faces; i++) {
+		face_meshlet[i] = -1;
+		face_visit[i] = -1;
+	}
+
+	int num_ordered = 0;
+	int seed = 0;
+	while (num_ordered < num_faces) {
+		while (face_meshlet[seed] != -1) {
+			seed++;
+		}
+
+		int meshlet_index = array_length(meshlets);
+		meshlet_t meshlet = { .first_face = num_ordered, .num_faces = 0 };
+		vec3_t axis = vec3_new(0, 0, 0);
+
+		int queue_head = 0;
+		int queue_tail = 0;
+		queue[queue_tail++] = seed;
+		face_visit[seed] = meshlet_index;
+
+		while (meshlet.num_faces < MESHLET_MAX_FACES && queue_head < queue_tail) {
+			int face = queue[queue_head++];
+
+			// Skip faces that would widen the normal cone too much
+			float axis_length = vec3_length(axis);
+			if (axis_length > 0 && vec3_dot(normals[face], axis) < MESHLET_NORMAL_THRESHOLD * axis_length) {
+				continue;
+			}
+
+			face_meshlet[face] = meshlet_index;
+			face_order[num_ordered++] = face;
+			meshlet.num_faces++;
+			axis = vec3_add(axis, normals[face]);
+
+			// Enqueue the unassigned faces sharing a vertex with this one
+			int face_vertices[3] = { faces[face].a, faces[face].b, faces[face].c };
+			for (int j = 0; j < 3; j++) {
+				for (int k = adjacency_offsets[face_vertices[j]]; k < adjacency_offsets[face_vertices[j] + 1]; k++) {
+					int neighbour = adjacency[k];
+					if (face_meshlet[neighbour] == -1 && face_visit[neighbour] != meshlet_index) {
+						face_visit[neighbour] = meshlet_index;
+						queue[queue_tail++] = neighbour;
+					}
+				}
+			}
+		}
+
+		array_push(meshlets, meshlet);
+	}
+
+	// Reorder faces (and their normals) so every meshlet is a contiguous range
+	face_t* original_faces = (face_t*)malloc(sizeof(face_t) * num_faces);
+	vec3_t* original_normals = (vec3_t*)malloc(sizeof(vec3_t) * num_faces);
+	memcpy(original_faces, faces, sizeof(face_t) * num_faces);
+	memcpy(original_normals, normals, sizeof(vec3_t) * num_faces);
+	for (int i = 0; i < num_faces; i++) {
+		faces[i] = original_faces[face_order[i]];
+		normals[i] = original_normals[face_order[i]];
+	}
+
+	for (int i = 0; i < array_length(meshlets); i++) {
+		compute_meshlet_bounds(&meshlets[i], faces, vertices, normals);
+	}
+
+	free(original_faces);
+	free(original_normals);
+	free(queue);
+	free(face_visit);
+	free(face_meshlet);
+	free(face_order);
+	free(adjacency);
+	free(adjacency_offsets);
+	free(normals);
+
+	return meshlets;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Return true if the whole meshlet can be rejected: either its bounding sphere
+// is outside the frustum or hidden behind the occluders, or every face inside
+// its normal cone is looking away from the camera (camera sits at the origin of
+// camera space).
+///////////////////////////////////////////////////////////////////////////////
+//
+//   cull when  dot(C, axis) >= sin(half_angle) * |C| + radius
+//
+///////////////////////////////////////////////////////////////////////////////
+bool is_meshlet_culled(meshlet_t* meshlet, mat4_t world_view_matrix, float max_scale, bool cull_backface, bool cull_occluded) {
+	vec3_t view_center = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, vec4_from_vec3(meshlet->center)));
+	float view_radius = meshlet->radius * max_scale;
+
+	if (is_sphere_outside_frustum(view_center, view_radius)) {
+		return true;
+	}
+
+	if (cull_backface && meshlet->cone_cutoff < 1) {
+		// Directions only take the rotational part of the matrix (w = 0)
+		vec4_t axis = { meshlet->cone_axis.x, meshlet->cone_axis.y, meshlet->cone_axis.z, 0 };
+		vec3_t view_axis = vec3_from_vec4(mat4_mul_vec4(world_view_matrix, axis));
+		vec3_normalize(&view_axis);
+
+		if (vec3_dot(view_center, view_axis) >= meshlet->cone_cutoff * vec3_length(view_center) + view_radius) {
+			return true;
+		}
+	}
+
+	if (cull_occluded && is_sphere_occluded(view_center, view_radius)) {
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,27 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+#include "triangle.h"
+
+#define MESHLET_MAX_FACES 64
+
+// A meshlet is a small cluster of neighbouring faces stored contiguously in the
+// mesh face array. Its bounding sphere and normal cone are kept in model space.
+typedef struct {
+	int first_face;
+	int num_faces;
+	vec3_t center;
+	float radius;
+	vec3_t cone_axis;
+	float cone_cutoff; // sine of the cone half-angle, 1 or more when the cone can't be culled
+} meshlet_t;
+
+meshlet_t* build_meshlets(face_t* faces, vec3_t* vertices);
+void get_bounding_sphere(vec3_t* vertices, int num_vertices, vec3_t* center, float* radius);
+
+bool is_meshlet_culled(meshlet_t* meshlet, mat4_t world_view_matrix, float max_scale, bool cull_backface, bool cull_occluded);
+
+#endif
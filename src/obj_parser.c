@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include "obj_parser.h"
+#include "array.h"
+#include "job.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// OBJ parser working straight on the mapped file: a first pass counts the
+// records so every array is allocated once, a second pass tokenizes the
+// numbers by hand (no per-line library calls). Supported records are
+// "v x y z", "vt u v" and "f" with any number of v, v/vt, v/vt/vn or v//vn
+// corners; negative indices count back from the last record read. Anything
+// else is skipped.
+//
+// Large files are split at line boundaries into chunks that are counted,
+// parsed and resolved on the job system. The prefix sums of the chunk counts
+// tell every chunk where its records go, so the chunks write straight into
+// the final arrays with global indices and nothing has to be concatenated.
+//
+// The face corners are then welded: every distinct (position, texture
+// coordinate) pair becomes one vertex and the faces index those vertices.
+// Normals are not read, faces are shaded from their geometric normal.
+///////////////////////////////////////////////////////////////////////////////
+#define OBJ_CHUNK_SIZE (1 << 20)
+#define NO_TEX_COORD INT_MIN
+
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+	1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static bool is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+static bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char* skip_blanks(const char* p, const char* end) {
+	while (p < end && is_blank(*p)) {
+		p++;
+	}
+	return p;
+}
+
+static const char* skip_token(const char* p, const char* end) {
+	while (p < end && !is_blank(*p) && *p != '\n') {
+		p++;
+	}
+	return p;
+}
+
+static const char* skip_line(const char* p, const char* end) {
+	while (p < end && *p != '\n') {
+		p++;
+	}
+	return p < end ? p + 1 : end;
+}
+
+// Parse a decimal number with an optional fraction and exponent. Up to 19
+// significant digits are kept in an integer, so the usual 6 to 9 digits of an
+// OBJ file are scaled exactly by the power of ten table.
+static const char* parse_float(const char* p, const char* end, float* value) {
+	bool is_negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		is_negative = *p == '-';
+		p++;
+	}
+
+	uint64_t mantissa = 0;
+	int num_digits = 0;
+	int exponent = 0;
+	for (; p < end && is_digit(*p); p++) {
+		if (num_digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			num_digits += mantissa > 0;
+		}
+		else {
+			exponent++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); p++) {
+			if (num_digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				num_digits += mantissa > 0;
+				exponent--;
+			}
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		bool is_exponent_negative = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			is_exponent_negative = *q == '-';
+			q++;
+		}
+		if (q < end && is_digit(*q)) {
+			int explicit_exponent = 0;
+			for (; q < end && is_digit(*q); q++) {
+				if (explicit_exponent < 10000) {
+					explicit_exponent = explicit_exponent * 10 + (*q - '0');
+				}
+			}
+			exponent += is_exponent_negative ? -explicit_exponent : explicit_exponent;
+			p = q;
+		}
+	}
+
+	double result = (double)mantissa;
+	if (exponent < 0 && exponent >= -22) {
+		result /= powers_of_ten[-exponent];
+	}
+	else if (exponent > 0 && exponent <= 22) {
+		result *= powers_of_ten[exponent];
+	}
+	else if (exponent != 0) {
+		result *= pow(10.0, exponent);
+	}
+	*value = (float)(is_negative ? -result : result);
+	return p;
+}
+
+static const char* parse_int(const char* p, const char* end, int* value) {
+	bool is_negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		is_negative = *p == '-';
+		p++;
+	}
+	int result = 0;
+	for (; p < end && is_digit(*p); p++) {
+		result = result * 10 + (*p - '0');
+	}
+	*value = is_negative ? -result : result;
+	return p;
+}
+
+static bool is_record(const char* p, const char* end, const char* name) {
+	for (; *name; name++, p++) {
+		if (p >= end || *p != *name) {
+			return false;
+		}
+	}
+	return p < end && is_blank(*p);
+}
+
+void count_obj_records(const char* begin, const char* end, obj_counts_t* counts) {
+	counts->num_vertices = 0;
+	counts->num_tex_coords = 0;
+	counts->num_faces = 0;
+
+	const char* p = begin;
+	while (p < end) {
+		p = skip_blanks(p, end);
+		if (is_record(p, end, "v")) {
+			counts->num_vertices++;
+		}
+		else if (is_record(p, end, "vt")) {
+			counts->num_tex_coords++;
+		}
+		else if (is_record(p, end, "f")) {
+			int num_corners = 0;
+			p = skip_blanks(p + 1, end);
+			while (p < end && *p != '\n') {
+				num_corners++;
+				p = skip_blanks(skip_token(p, end), end);
+			}
+			counts->num_faces += num_corners >= 3 ? num_corners - 2 : 0;
+		}
+		p = skip_line(p, end);
+	}
+}
+
+// Turn a 1-based or negative (relative) OBJ index into a 0-based one
+static int resolve_index(int index, int num_read) {
+	return index < 0 ? num_read + index : index - 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parse the records into arrays sized by count_obj_records, starting at the
+// positions in counts (which are advanced). The faces index the positions,
+// their texture coordinate indices are kept aside (3 per face) for welding.
+///////////////////////////////////////////////////////////////////////////////
+static void parse_obj_records(const char* begin, const char* end, vec3_t* vertices, tex2_t* tex_coords, face_t* faces, int* face_tex_indices, obj_counts_t* counts) {
+	const char* p = begin;
+	while (p < end) {
+		p = skip_blanks(p, end);
+		if (is_record(p, end, "v")) {
+			vec3_t* vertex = &vertices[counts->num_vertices++];
+			p = parse_float(skip_blanks(p + 1, end), end, &vertex->x);
+			p = parse_float(skip_blanks(p, end), end, &vertex->y);
+			p = parse_float(skip_blanks(p, end), end, &vertex->z);
+		}
+		else if (is_record(p, end, "vt")) {
+			tex2_t* tex_coord = &tex_coords[counts->num_tex_coords++];
+			p = parse_float(skip_blanks(p + 2, end), end, &tex_coord->u);
+			p = parse_float(skip_blanks(p, end), end, &tex_coord->v);
+			// Flip the V component to account for inverted UV-coordinates (V grows downwards)
+			tex_coord->v = 1 - tex_coord->v;
+		}
+		else if (is_record(p, end, "f")) {
+			int first_vertex = 0;
+			int first_tex = 0;
+			int previous_vertex = 0;
+			int previous_tex = 0;
+			int num_corners = 0;
+
+			p = skip_blanks(p + 1, end);
+			while (p < end && *p != '\n') {
+				int vertex_index = 0;
+				int tex_index = 0;
+				p = parse_int(p, end, &vertex_index);
+				if (p < end && *p == '/') {
+					p++;
+					if (p < end && *p != '/') {
+						p = parse_int(p, end, &tex_index);
+					}
+				}
+				p = skip_blanks(skip_token(p, end), end);
+
+				int vertex = resolve_index(vertex_index, counts->num_vertices);
+				int tex = tex_index != 0 ? resolve_index(tex_index, counts->num_tex_coords) : NO_TEX_COORD;
+
+				// Split the polygon into a fan around its first corner
+				if (num_corners == 0) {
+					first_vertex = vertex;
+					first_tex = tex;
+				}
+				else if (num_corners >= 2) {
+					faces[counts->num_faces] = (face_t){
+						.a = first_vertex,
+						.b = previous_vertex,
+						.c = vertex
+					};
+					int* tex_indices = &face_tex_indices[counts->num_faces * 3];
+					tex_indices[0] = first_tex;
+					tex_indices[1] = previous_tex;
+					tex_indices[2] = tex;
+					counts->num_faces++;
+				}
+				previous_vertex = vertex;
+				previous_tex = tex;
+				num_corners++;
+			}
+		}
+		p = skip_line(p, end);
+	}
+}
+
+typedef struct {
+	const char* begin;
+	const char* end;
+	obj_counts_t counts; // records in the chunk
+	obj_counts_t first; // position of the first record of the chunk in the arrays
+	int num_invalid_faces;
+} obj_chunk_t;
+
+typedef struct {
+	obj_chunk_t* chunks;
+	obj_counts_t totals;
+	vec3_t* vertices;
+	tex2_t* tex_coords;
+	face_t* faces;
+	int* face_tex_indices;
+} obj_parse_t;
+
+static void count_chunk_job(void* data, int index, int thread_index) {
+	obj_chunk_t* chunk = &((obj_parse_t*)data)->chunks[index];
+	count_obj_records(chunk->begin, chunk->end, &chunk->counts);
+}
+
+static void parse_chunk_job(void* data, int index, int thread_index) {
+	obj_parse_t* parse = (obj_parse_t*)data;
+	obj_chunk_t* chunk = &parse->chunks[index];
+	obj_counts_t counts = chunk->first;
+	parse_obj_records(chunk->begin, chunk->end, parse->vertices, parse->tex_coords, parse->faces, parse->face_tex_indices, &counts);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Flag (a = -1) the chunk faces pointing outside the arrays
+///////////////////////////////////////////////////////////////////////////////
+static void resolve_chunk_job(void* data, int index, int thread_index) {
+	obj_parse_t* parse = (obj_parse_t*)data;
+	obj_chunk_t* chunk = &parse->chunks[index];
+	chunk->num_invalid_faces = 0;
+
+	for (int i = chunk->first.num_faces; i < chunk->first.num_faces + chunk->counts.num_faces; i++) {
+		face_t* face = &parse->faces[i];
+		int vertex_indices[3] = { face->a, face->b, face->c };
+		int* tex_indices = &parse->face_tex_indices[i * 3];
+
+		bool is_valid = true;
+		for (int j = 0; j < 3; j++) {
+			bool has_tex_coord = tex_indices[j] != NO_TEX_COORD;
+			is_valid = is_valid &&
+				vertex_indices[j] >= 0 && vertex_indices[j] < parse->totals.num_vertices &&
+				(!has_tex_coord || (tex_indices[j] >= 0 && tex_indices[j] < parse->totals.num_tex_coords));
+		}
+
+		if (!is_valid) {
+			face->a = -1;
+			chunk->num_invalid_faces++;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Weld the corners of the valid faces into unique vertices, in the order the
+// faces first use them, and compact the faces. Corners are hashed on their
+// position index: every position heads a short chain of the vertices made
+// from it, one per texture coordinate it is used with.
+///////////////////////////////////////////////////////////////////////////////
+static void weld_vertices(obj_parse_t* parse, vec3_t** vertices, tex2_t** uvs) {
+	int num_faces = parse->totals.num_faces;
+	int* position_heads = (int*)malloc(sizeof(int) * (parse->totals.num_vertices + 1));
+	int* vertex_positions = (int*)malloc(sizeof(int) * (num_faces * 3 + 1));
+	int* vertex_tex_indices = (int*)malloc(sizeof(int) * (num_faces * 3 + 1));
+	int* vertex_next = (int*)malloc(sizeof(int) * (num_faces * 3 + 1));
+	for (int i = 0; i < parse->totals.num_vertices; i++) {
+		position_heads[i] = -1;
+	}
+
+	int num_welded = 0;
+	int num_kept = 0;
+	for (int i = 0; i < num_faces; i++) {
+		face_t face = parse->faces[i];
+		if (face.a < 0) {
+			continue;
+		}
+
+		int* corners[3] = { &face.a, &face.b, &face.c };
+		for (int j = 0; j < 3; j++) {
+			int position = *corners[j];
+			int tex = parse->face_tex_indices[i * 3 + j];
+
+			int vertex = position_heads[position];
+			while (vertex >= 0 && vertex_tex_indices[vertex] != tex) {
+				vertex = vertex_next[vertex];
+			}
+			if (vertex < 0) {
+				vertex = num_welded++;
+				vertex_positions[vertex] = position;
+				vertex_tex_indices[vertex] = tex;
+				vertex_next[vertex] = position_heads[position];
+				position_heads[position] = vertex;
+			}
+			*corners[j] = vertex;
+		}
+		parse->faces[num_kept++] = face;
+	}
+
+	*vertices = (vec3_t*)array_hold(NULL, num_welded, sizeof(vec3_t));
+	*uvs = (tex2_t*)array_hold(NULL, num_welded, sizeof(tex2_t));
+	for (int i = 0; i < num_welded; i++) {
+		(*vertices)[i] = parse->vertices[vertex_positions[i]];
+		(*uvs)[i] = vertex_tex_indices[i] != NO_TEX_COORD ? parse->tex_coords[vertex_tex_indices[i]] : (tex2_t){ 0, 0 };
+	}
+
+	if (num_kept < num_faces) {
+		array_clear(parse->faces);
+		parse->faces = (face_t*)array_hold(parse->faces, num_kept, sizeof(face_t));
+	}
+
+	free(vertex_next);
+	free(vertex_tex_indices);
+	free(vertex_positions);
+	free(position_heads);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Parse a whole OBJ file into new vertex, texture coordinate and face arrays
+///////////////////////////////////////////////////////////////////////////////
+void parse_obj(const char* text, size_t size, vec3_t** vertices, tex2_t** uvs, face_t** faces) {
+	const char* end = text + size;
+	obj_parse_t parse = { 0 };
+
+	// Split the text into chunks ending at line boundaries
+	int num_chunks = (int)(size / OBJ_CHUNK_SIZE) + 1;
+	parse.chunks = (obj_chunk_t*)calloc(num_chunks, sizeof(obj_chunk_t));
+	const char* chunk_begin = text;
+	for (int i = 0; i < num_chunks; i++) {
+		const char* chunk_end = end;
+		if (i < num_chunks - 1) {
+			chunk_end = text + size / num_chunks * (i + 1);
+			chunk_end = chunk_end > chunk_begin ? skip_line(chunk_end, end) : chunk_begin;
+		}
+		parse.chunks[i].begin = chunk_begin;
+		parse.chunks[i].end = chunk_end;
+		chunk_begin = chunk_end;
+	}
+
+	run_jobs(count_chunk_job, &parse, num_chunks);
+
+	// Prefix sums of the counts give every chunk its place in the arrays
+	for (int i = 0; i < num_chunks; i++) {
+		parse.chunks[i].first = parse.totals;
+		parse.totals.num_vertices += parse.chunks[i].counts.num_vertices;
+		parse.totals.num_tex_coords += parse.chunks[i].counts.num_tex_coords;
+		parse.totals.num_faces += parse.chunks[i].counts.num_faces;
+	}
+
+	parse.vertices = (vec3_t*)malloc(sizeof(vec3_t) * (parse.totals.num_vertices + 1));
+	parse.faces = (face_t*)array_hold(NULL, parse.totals.num_faces, sizeof(face_t));
+	parse.tex_coords = (tex2_t*)malloc(sizeof(tex2_t) * (parse.totals.num_tex_coords + 1));
+	parse.face_tex_indices = (int*)malloc(sizeof(int) * (parse.totals.num_faces * 3 + 1));
+
+	run_jobs(parse_chunk_job, &parse, num_chunks);
+	run_jobs(resolve_chunk_job, &parse, num_chunks);
+
+	// The faces flagged as invalid are dropped while welding
+	int num_invalid_faces = 0;
+	for (int i = 0; i < num_chunks; i++) {
+		num_invalid_faces += parse.chunks[i].num_invalid_faces;
+	}
+	if (num_invalid_faces > 0) {
+		fprintf(stderr, "Skipped %d faces with invalid indices\n", num_invalid_faces);
+	}
+
+	weld_vertices(&parse, vertices, uvs);
+	*faces = parse.faces;
+
+	free(parse.vertices);
+	free(parse.face_tex_indices);
+	free(parse.tex_coords);
+	free(parse.chunks);
+}
@@ -0,0 +1,20 @@
+#ifndef OBJ_PARSER_H
+#define OBJ_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "vector.h"
+#include "triangle.h"
+
+// Number of records in a piece of OBJ text, faces counted as triangles
+// (polygons are split into fans)
+typedef struct {
+	int num_vertices;
+	int num_tex_coords;
+	int num_faces;
+} obj_counts_t;
+
+void count_obj_records(const char* begin, const char* end, obj_counts_t* counts);
+void parse_obj(const char* text, size_t size, vec3_t** vertices, tex2_t** uvs, face_t** faces);
+
+#endif
@@ -0,0 +1,171 @@
+#include <math.h>
+#include "occlusion.h"
+#include "display.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// The occlusion buffer is a low resolution depth buffer covering the whole
+// screen. Every cell keeps the depth (1 - 1/w, like the z-buffer) behind which
+// everything is known to be hidden by an occluder rasterized this frame.
+///////////////////////////////////////////////////////////////////////////////
+static float occlusion_buffer[OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT];
+static bool occlusion_culling = true;
+
+static float proj_scale_x = 1;
+static float proj_scale_y = 1;
+static float near_plane = 0.1;
+
+// Size of the screen the occluder triangles were projected to
+static int viewport_width = 1;
+static int viewport_height = 1;
+
+void init_occlusion_buffer(mat4_t proj_matrix, float z_near)
+{
+	proj_scale_x = proj_matrix.m[0][0];
+	proj_scale_y = proj_matrix.m[1][1];
+	near_plane = z_near;
+	set_occlusion_viewport(get_window_width(), get_window_height());
+	clear_occlusion_buffer();
+}
+
+void set_occlusion_viewport(int width, int height)
+{
+	viewport_width = width;
+	viewport_height = height;
+}
+
+void clear_occlusion_buffer(void)
+{
+	for (int i = 0; i < OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT; i++) {
+		occlusion_buffer[i] = 1.0;
+	}
+}
+
+void set_occlusion_culling(bool enabled)
+{
+	occlusion_culling = enabled;
+}
+
+bool is_occlusion_culling(void)
+{
+	return occlusion_culling;
+}
+
+static float edge_function(vec2_t a, vec2_t b, vec2_t p)
+{
+	return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+}
+
+// How much lower the edge function can get anywhere in a cell than at its center
+static float edge_cell_margin(vec2_t a, vec2_t b)
+{
+	return 0.5 * (fabsf(b.x - a.x) + fabsf(b.y - a.y));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Rasterize a screen space triangle into the occlusion buffer. Only the cells
+// entirely inside the triangle are written (the edge tests at the cell centers
+// are moved half a cell inwards), with the farthest vertex depth, so a cell
+// never hides anything that shows next to the triangle or in front of it.
+///////////////////////////////////////////////////////////////////////////////
+void rasterize_occluder(triangle_t* triangle)
+{
+	float scale_x = (float)OCCLUSION_BUFFER_WIDTH / viewport_width;
+	float scale_y = (float)OCCLUSION_BUFFER_HEIGHT / viewport_height;
+
+	vec2_t a = { triangle->points[0].x * scale_x, triangle->points[0].y * scale_y };
+	vec2_t b = { triangle->points[1].x * scale_x, triangle->points[1].y * scale_y };
+	vec2_t c = { triangle->points[2].x * scale_x, triangle->points[2].y * scale_y };
+
+	float area = edge_function(a, b, c);
+	if (area == 0) {
+		return;
+	}
+	float orientation = area > 0 ? 1 : -1;
+	float margin_bc = edge_cell_margin(b, c);
+	float margin_ca = edge_cell_margin(c, a);
+	float margin_ab = edge_cell_margin(a, b);
+
+	float depth = 0;
+	for (int i = 0; i < 3; i++) {
+		depth = fmaxf(depth, 1.0 - 1.0 / triangle->points[i].w);
+	}
+
+	int x_start = (int)fmaxf(0, floorf(fminf(a.x, fminf(b.x, c.x))));
+	int x_end = (int)fminf(OCCLUSION_BUFFER_WIDTH - 1, ceilf(fmaxf(a.x, fmaxf(b.x, c.x))));
+	int y_start = (int)fmaxf(0, floorf(fminf(a.y, fminf(b.y, c.y))));
+	int y_end = (int)fminf(OCCLUSION_BUFFER_HEIGHT - 1, ceilf(fmaxf(a.y, fmaxf(b.y, c.y))));
+
+	for (int y = y_start; y <= y_end; y++) {
+		for (int x = x_start; x <= x_end; x++) {
+			vec2_t p = { x + 0.5, y + 0.5 };
+			if (edge_function(b, c, p) * orientation < margin_bc ||
+				edge_function(c, a, p) * orientation < margin_ca ||
+				edge_function(a, b, p) * orientation < margin_ab) {
+				continue;
+			}
+
+			float* cell = &occlusion_buffer[OCCLUSION_BUFFER_WIDTH * y + x];
+			if (depth < *cell) {
+				*cell = depth;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Large spheres (on screen) or spheres crossing the near plane make good occluders
+///////////////////////////////////////////////////////////////////////////////
+bool is_sphere_occluder(vec3_t center, float radius)
+{
+	if (center.z - radius <= near_plane) {
+		return true;
+	}
+	float screen_radius = proj_scale_y * radius / center.z * (OCCLUSION_BUFFER_HEIGHT / 2.0);
+	return screen_radius >= OCCLUDER_MIN_SCREEN_RADIUS;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Test a camera space bounding sphere against the occlusion buffer. The sphere
+// is hidden when its nearest depth is behind the occluders in every cell of its
+// projected rectangle.
+///////////////////////////////////////////////////////////////////////////////
+bool is_sphere_occluded(vec3_t center, float radius)
+{
+	float z_min = center.z - radius;
+	float z_max = center.z + radius;
+
+	// Spheres crossing the near plane cover an unbounded part of the screen
+	if (z_min <= near_plane) {
+		return false;
+	}
+
+	// x/z and y/z reach their extremes at the corners of the box around the sphere
+	float min_x = fminf((center.x - radius) / z_min, (center.x - radius) / z_max) * proj_scale_x;
+	float max_x = fmaxf((center.x + radius) / z_min, (center.x + radius) / z_max) * proj_scale_x;
+	float min_y = fminf((center.y - radius) / z_min, (center.y - radius) / z_max) * proj_scale_y;
+	float max_y = fmaxf((center.y + radius) / z_min, (center.y + radius) / z_max) * proj_scale_y;
+
+	// Map from normalized device coordinates to cells (screen y is flipped)
+	int x_start = (int)floorf((min_x + 1) * 0.5 * OCCLUSION_BUFFER_WIDTH);
+	int x_end = (int)floorf((max_x + 1) * 0.5 * OCCLUSION_BUFFER_WIDTH);
+	int y_start = (int)floorf((1 - max_y) * 0.5 * OCCLUSION_BUFFER_HEIGHT);
+	int y_end = (int)floorf((1 - min_y) * 0.5 * OCCLUSION_BUFFER_HEIGHT);
+
+	x_start = x_start < 0 ? 0 : x_start;
+	y_start = y_start < 0 ? 0 : y_start;
+	x_end = x_end >= OCCLUSION_BUFFER_WIDTH ? OCCLUSION_BUFFER_WIDTH - 1 : x_end;
+	y_end = y_end >= OCCLUSION_BUFFER_HEIGHT ? OCCLUSION_BUFFER_HEIGHT - 1 : y_end;
+	if (x_start > x_end || y_start > y_end) {
+		return false;
+	}
+
+	float depth = 1.0 - 1.0 / z_min;
+	for (int y = y_start; y <= y_end; y++) {
+		for (int x = x_start; x <= x_end; x++) {
+			if (occlusion_buffer[OCCLUSION_BUFFER_WIDTH * y + x] >= depth) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "matrix.h"
+#include "triangle.h"
+
+#define OCCLUSION_BUFFER_WIDTH 256
+#define OCCLUSION_BUFFER_HEIGHT 128
+
+// Meshes whose bounding sphere covers at least this many occlusion buffer rows
+// (in radius) are rasterized as occluders
+#define OCCLUDER_MIN_SCREEN_RADIUS 8
+
+void init_occlusion_buffer(mat4_t proj_matrix, float z_near);
+void clear_occlusion_buffer(void);
+void set_occlusion_viewport(int width, int height);
+
+void set_occlusion_culling(bool enabled);
+bool is_occlusion_culling(void);
+
+void rasterize_occluder(triangle_t* triangle);
+bool is_sphere_occluder(vec3_t center, float radius);
+bool is_sphere_occluded(vec3_t center, float radius);
+
+#endif
@@ -0,0 +1,66 @@
+#include <SDL.h>
+#include "pacer.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Frame pacer on the monotonic performance counter. Every frame has an
+// absolute deadline one period after the previous one, so rounding errors
+// don't accumulate. The pacer sleeps while the deadline is far away (sleep
+// granularity is about a millisecond) and spins for the rest. A frame rate of
+// 0 disables pacing.
+///////////////////////////////////////////////////////////////////////////////
+static uint64_t frame_period = 0;
+static uint64_t next_deadline = 0;
+static uint64_t previous_frame_time = 0;
+
+uint64_t get_time_ns(void) {
+	uint64_t counter = SDL_GetPerformanceCounter();
+	uint64_t frequency = SDL_GetPerformanceFrequency();
+
+	// Split the conversion so counter * 1e9 can't overflow
+	return (counter / frequency) * 1000000000 + (counter % frequency) * 1000000000 / frequency;
+}
+
+void init_frame_pacer(double frame_rate) {
+	frame_period = frame_rate > 0 ? (uint64_t)(1000000000.0 / frame_rate) : 0;
+	previous_frame_time = get_time_ns();
+	next_deadline = previous_frame_time + frame_period;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait until the next frame is due, return the seconds since the last frame
+///////////////////////////////////////////////////////////////////////////////
+double wait_for_next_frame(void) {
+	if (frame_period > 0) {
+		uint64_t now = get_time_ns();
+		while (now < next_deadline) {
+			uint64_t remaining = next_deadline - now;
+			if (remaining > PACER_SPIN_THRESHOLD_NS) {
+				SDL_Delay((Uint32)((remaining - PACER_SPIN_THRESHOLD_NS) / 1000000));
+			}
+			now = get_time_ns();
+		}
+
+		// After a long frame start over from now instead of rushing to catch up
+		next_deadline += frame_period;
+		if (next_deadline < now) {
+			next_deadline = now + frame_period;
+		}
+	}
+
+	uint64_t now = get_time_ns();
+	double delta = (now - previous_frame_time) / 1000000000.0;
+	previous_frame_time = now;
+	return delta;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Milliseconds left until the next frame is due, rounded up so a timed wait
+// never ends before the deadline
+///////////////////////////////////////////////////////////////////////////////
+int get_time_to_next_frame(void) {
+	uint64_t now = get_time_ns();
+	if (frame_period == 0 || now >= next_deadline) {
+		return 0;
+	}
+	return (int)((next_deadline - now + 999999) / 1000000);
+}
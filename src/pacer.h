@@ -0,0 +1,15 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+// Below this much time left before the deadline the pacer spins instead of sleeping
+#define PACER_SPIN_THRESHOLD_NS 2000000
+
+uint64_t get_time_ns(void);
+
+void init_frame_pacer(double frame_rate);
+double wait_for_next_frame(void);
+int get_time_to_next_frame(void);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <math.h>
+#include "quantize.h"
+
+// SSE2 is part of every x64 target, 32-bit builds need it enabled explicitly
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define QUANTIZE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Map value from [offset, offset + scale * QUANTIZE_MAX_VALUE] to the nearest step
+static uint16_t quantize_value(float value, float offset, float scale) {
+	if (scale == 0) {
+		return 0;
+	}
+	float steps = (value - offset) / scale + 0.5f;
+	return (uint16_t)fminf(fmaxf(steps, 0), QUANTIZE_MAX_VALUE);
+}
+
+static float get_quantize_scale(float min, float max) {
+	return (max - min) / QUANTIZE_MAX_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Quantize the positions against their bounding box and the texture
+// coordinates against their range, 16 bits per component. The error is half
+// a step: the size of the box divided by 2 * QUANTIZE_MAX_VALUE.
+///////////////////////////////////////////////////////////////////////////////
+void quantize_vertices(quantized_vertices_t* quantized, vec3_t* vertices, tex2_t* uvs, int num_vertices) {
+	vec3_t min = vec3_new(0, 0, 0);
+	vec3_t max = vec3_new(0, 0, 0);
+	tex2_t uv_min = { 0, 0 };
+	tex2_t uv_max = { 0, 0 };
+	for (int i = 0; i < num_vertices; i++) {
+		min.x = i == 0 ? vertices[i].x : fminf(min.x, vertices[i].x);
+		min.y = i == 0 ? vertices[i].y : fminf(min.y, vertices[i].y);
+		min.z = i == 0 ? vertices[i].z : fminf(min.z, vertices[i].z);
+		max.x = i == 0 ? vertices[i].x : fmaxf(max.x, vertices[i].x);
+		max.y = i == 0 ? vertices[i].y : fmaxf(max.y, vertices[i].y);
+		max.z = i == 0 ? vertices[i].z : fmaxf(max.z, vertices[i].z);
+		uv_min.u = i == 0 ? uvs[i].u : fminf(uv_min.u, uvs[i].u);
+		uv_min.v = i == 0 ? uvs[i].v : fminf(uv_min.v, uvs[i].v);
+		uv_max.u = i == 0 ? uvs[i].u : fmaxf(uv_max.u, uvs[i].u);
+		uv_max.v = i == 0 ? uvs[i].v : fmaxf(uv_max.v, uvs[i].v);
+	}
+
+	quantized->position_offset = min;
+	quantized->position_scale = vec3_new(
+		get_quantize_scale(min.x, max.x),
+		get_quantize_scale(min.y, max.y),
+		get_quantize_scale(min.z, max.z)
+	);
+	quantized->uv_offset = uv_min;
+	quantized->uv_scale = (tex2_t){ get_quantize_scale(uv_min.u, uv_max.u), get_quantize_scale(uv_min.v, uv_max.v) };
+
+	quantized->positions = (quantized_position_t*)malloc(sizeof(quantized_position_t) * (num_vertices + 1));
+	quantized->uvs = (quantized_uv_t*)malloc(sizeof(quantized_uv_t) * (num_vertices + 1));
+
+	vec3_t offset = quantized->position_offset;
+	vec3_t scale = quantized->position_scale;
+	for (int i = 0; i < num_vertices; i++) {
+		quantized->positions[i] = (quantized_position_t){
+			quantize_value(vertices[i].x, offset.x, scale.x),
+			quantize_value(vertices[i].y, offset.y, scale.y),
+			quantize_value(vertices[i].z, offset.z, scale.z),
+			0
+		};
+		quantized->uvs[i] = (quantized_uv_t){
+			quantize_value(uvs[i].u, uv_min.u, quantized->uv_scale.u),
+			quantize_value(uvs[i].v, uv_min.v, quantized->uv_scale.v)
+		};
+	}
+}
+
+void free_quantized_vertices(quantized_vertices_t* quantized) {
+	free(quantized->positions);
+	free(quantized->uvs);
+	quantized->positions = NULL;
+	quantized->uvs = NULL;
+}
+
+tex2_t dequantize_uv(quantized_vertices_t* quantized, int index) {
+	quantized_uv_t uv = quantized->uvs[index];
+	return (tex2_t){
+		quantized->uv_offset.u + quantized->uv_scale.u * uv.u,
+		quantized->uv_offset.v + quantized->uv_scale.v * uv.v
+	};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform the vertices [first_vertex, last_vertex) by matrix, writing the
+// results from output[first_vertex]. The dequantization (scale, then offset)
+// is folded into the matrix, so the 16-bit values are converted to floats and
+// go through a single matrix multiply.
+///////////////////////////////////////////////////////////////////////////////
+void transform_quantized_vertices(quantized_vertices_t* quantized, mat4_t matrix, int first_vertex, int last_vertex, vec4_t* output) {
+	vec3_t offset = quantized->position_offset;
+	vec3_t scale = quantized->position_scale;
+	mat4_t dequantize_matrix = mat4_mul_mat4(
+		mat4_make_translation(offset.x, offset.y, offset.z),
+		mat4_make_scale(scale.x, scale.y, scale.z)
+	);
+	mat4_t m = mat4_mul_mat4(matrix, dequantize_matrix);
+
+#ifdef QUANTIZE_SSE2
+	__m128 column_x = _mm_setr_ps(m.m[0][0], m.m[1][0], m.m[2][0], m.m[3][0]);
+	__m128 column_y = _mm_setr_ps(m.m[0][1], m.m[1][1], m.m[2][1], m.m[3][1]);
+	__m128 column_z = _mm_setr_ps(m.m[0][2], m.m[1][2], m.m[2][2], m.m[3][2]);
+	__m128 column_w = _mm_setr_ps(m.m[0][3], m.m[1][3], m.m[2][3], m.m[3][3]);
+	__m128i zero = _mm_setzero_si128();
+
+	for (int i = first_vertex; i < last_vertex; i++) {
+		// Widen x, y, z (and the padding) to 32-bit integers, then to floats
+		__m128i packed = _mm_loadl_epi64((const __m128i*)&quantized->positions[i]);
+		__m128 position = _mm_cvtepi32_ps(_mm_unpacklo_epi16(packed, zero));
+
+		__m128 result = _mm_add_ps(
+			_mm_add_ps(
+				_mm_mul_ps(column_x, _mm_shuffle_ps(position, position, _MM_SHUFFLE(0, 0, 0, 0))),
+				_mm_mul_ps(column_y, _mm_shuffle_ps(position, position, _MM_SHUFFLE(1, 1, 1, 1)))
+			),
+			_mm_add_ps(
+				_mm_mul_ps(column_z, _mm_shuffle_ps(position, position, _MM_SHUFFLE(2, 2, 2, 2))),
+				column_w
+			)
+		);
+		_mm_storeu_ps(&output[i].x, result);
+	}
+#else
+	for (int i = first_vertex; i < last_vertex; i++) {
+		quantized_position_t position = quantized->positions[i];
+		vec4_t vertex = { position.x, position.y, position.z, 1 };
+		output[i] = mat4_mul_vec4(m, vertex);
+	}
+#endif
+}
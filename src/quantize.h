@@ -0,0 +1,45 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include "vector.h"
+#include "matrix.h"
+#include "texture.h"
+
+#define QUANTIZE_MAX_VALUE 65535
+
+// Meshes with more vertices than this keep 32-bit indices
+#define QUANTIZE_MAX_SHORT_INDEX_VERTICES 65536
+
+// Position quantized to 16 bits per axis against the mesh bounding box, padded
+// to 8 bytes so a vertex is fetched with a single 64-bit load
+typedef struct {
+	uint16_t x;
+	uint16_t y;
+	uint16_t z;
+	uint16_t pad;
+} quantized_position_t;
+
+// Texture coordinate quantized to 16 bits against the range used by the mesh
+typedef struct {
+	uint16_t u;
+	uint16_t v;
+} quantized_uv_t;
+
+// Compact vertex storage: value = offset + scale * quantized value
+typedef struct {
+	quantized_position_t* positions;
+	quantized_uv_t* uvs;
+	vec3_t position_offset;
+	vec3_t position_scale;
+	tex2_t uv_offset;
+	tex2_t uv_scale;
+} quantized_vertices_t;
+
+void quantize_vertices(quantized_vertices_t* quantized, vec3_t* vertices, tex2_t* uvs, int num_vertices);
+void free_quantized_vertices(quantized_vertices_t* quantized);
+
+tex2_t dequantize_uv(quantized_vertices_t* quantized, int index);
+void transform_quantized_vertices(quantized_vertices_t* quantized, mat4_t matrix, int first_vertex, int last_vertex, vec4_t* output);
+
+#endif
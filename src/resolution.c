@@ -0,0 +1,36 @@
+#include <math.h>
+#include "resolution.h"
+#include "display.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Dynamic resolution controller: scales the render resolution (both axes by
+// the same factor) so the measured raster time stays under the frame budget.
+// Raster time grows with the number of pixels, i.e. with the square of the
+// scale. Spikes are followed quickly, the resolution recovers slowly.
+///////////////////////////////////////////////////////////////////////////////
+static float resolution_scale = 1;
+static float min_resolution_scale = 1;
+static float max_resolution_scale = 1;
+
+void init_resolution_scaling(float min_scale, float max_scale) {
+	min_resolution_scale = min_scale;
+	max_resolution_scale = max_scale;
+	resolution_scale = max_scale;
+}
+
+void update_resolution_scaling(float raster_time) {
+	if (min_resolution_scale >= max_resolution_scale) {
+		return;
+	}
+
+	float budget = FRAME_TARGET_TIME * RESOLUTION_TARGET_LOAD;
+	float target_scale = resolution_scale * sqrtf(budget / fmaxf(raster_time, 0.01f));
+
+	float rate = target_scale < resolution_scale ? RESOLUTION_DECREASE_RATE : RESOLUTION_INCREASE_RATE;
+	resolution_scale += (target_scale - resolution_scale) * rate;
+	resolution_scale = fminf(fmaxf(resolution_scale, min_resolution_scale), max_resolution_scale);
+}
+
+float get_resolution_scale(void) {
+	return resolution_scale;
+}
@@ -0,0 +1,15 @@
+#ifndef RESOLUTION_H
+#define RESOLUTION_H
+
+// Fraction of FRAME_TARGET_TIME the rasterization is allowed to take
+#define RESOLUTION_TARGET_LOAD 0.9f
+
+// Smoothing applied when lowering (fast) and raising (slow) the resolution
+#define RESOLUTION_DECREASE_RATE 0.5f
+#define RESOLUTION_INCREASE_RATE 0.1f
+
+void init_resolution_scaling(float min_scale, float max_scale);
+void update_resolution_scaling(float raster_time);
+float get_resolution_scale(void);
+
+#endif
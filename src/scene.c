@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scene.h"
+#include "array.h"
+#include "texture.h"
+
+#define SCENE_LINE_MAX_LENGTH 1024
+
+// The secure CRT of MSVC wants the size of every %s buffer, the standard one doesn't
+#ifdef _WIN32
+#define scan_record sscanf_s
+#define SCAN_STRING(buffer) buffer, (unsigned)sizeof(buffer)
+#else
+#define scan_record sscanf
+#define SCAN_STRING(buffer) buffer
+#endif
+
+static object_t* objects = NULL;
+
+// An object or instances record of the scene file, with its assets as indices
+// into the lists of unique file names. An object is a grid of 1 x 1 x 1.
+typedef struct {
+	int mesh;
+	int texture;
+	int count[3];
+	vec3_t spacing;
+	vec3_t scale;
+	vec3_t translation;
+	vec3_t rotation;
+} scene_record_t;
+
+static int add_unique_name(char*** names, const char* name) {
+	for (int i = 0; i < array_length(*names); i++) {
+		if (strcmp((*names)[i], name) == 0) {
+			return i;
+		}
+	}
+
+	size_t size = strlen(name) + 1;
+	char* copy = (char*)malloc(size);
+	memcpy(copy, name, size);
+	array_push(*names, copy);
+	return array_length(*names) - 1;
+}
+
+static void free_names(char** names) {
+	for (int i = 0; i < array_length(names); i++) {
+		free(names[i]);
+	}
+	array_free(names);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Load a scene description (see assets/default.scene for the format). The
+// whole file is read first, so every asset is loaded once for all the objects
+// using it: the textures are decoded as one parallel batch, then the meshes
+// are loaded (each one is parsed in parallel chunks or mapped from its cache).
+///////////////////////////////////////////////////////////////////////////////
+bool load_scene(const char* filename) {
+	FILE* file = NULL;
+#ifdef _WIN32
+	fopen_s(&file, filename, "r");
+#else
+	file = fopen(filename, "r");
+#endif
+	if (!file) {
+		fprintf(stderr, "Error opening the scene %s\n", filename);
+		return false;
+	}
+
+	scene_record_t* records = NULL;
+	char** mesh_names = NULL;
+	char** texture_names = NULL;
+	bool is_valid = true;
+
+	char line[SCENE_LINE_MAX_LENGTH];
+	for (int line_number = 1; fgets(line, SCENE_LINE_MAX_LENGTH, file); line_number++) {
+		char keyword[32];
+		if (scan_record(line, "%31s", SCAN_STRING(keyword)) != 1 || keyword[0] == '#') {
+			continue;
+		}
+
+		char obj_filename[SCENE_LINE_MAX_LENGTH];
+		char png_filename[SCENE_LINE_MAX_LENGTH];
+		scene_record_t record = {
+			.count = { 1, 1, 1 },
+			.spacing = vec3_new(0, 0, 0),
+			.scale = vec3_new(1, 1, 1),
+			.rotation = vec3_new(0, 0, 0)
+		};
+		int num_values = 0;
+		if (strcmp(keyword, "object") == 0) {
+			num_values = scan_record(
+				line, "object %1023s %1023s %f %f %f %f %f %f %f %f %f",
+				SCAN_STRING(obj_filename), SCAN_STRING(png_filename),
+				&record.translation.x, &record.translation.y, &record.translation.z,
+				&record.rotation.x, &record.rotation.y, &record.rotation.z,
+				&record.scale.x, &record.scale.y, &record.scale.z
+			);
+		}
+		else if (strcmp(keyword, "instances") == 0) {
+			// Same values as an object, preceded by the grid size and followed by the spacing
+			num_values = scan_record(
+				line, "instances %1023s %1023s %d %d %d %f %f %f %f %f %f %f %f %f %f %f %f",
+				SCAN_STRING(obj_filename), SCAN_STRING(png_filename),
+				&record.count[0], &record.count[1], &record.count[2],
+				&record.translation.x, &record.translation.y, &record.translation.z,
+				&record.spacing.x, &record.spacing.y, &record.spacing.z,
+				&record.rotation.x, &record.rotation.y, &record.rotation.z,
+				&record.scale.x, &record.scale.y, &record.scale.z
+			);
+			num_values -= 6;
+			if (record.count[0] < 1 || record.count[1] < 1 || record.count[2] < 1) {
+				num_values = 0;
+			}
+		}
+		if (num_values != 5 && num_values != 8 && num_values != 11) {
+			fprintf(stderr, "%s:%d: invalid record: %s", filename, line_number, line);
+			is_valid = false;
+			break;
+		}
+
+		record.mesh = add_unique_name(&mesh_names, obj_filename);
+		record.texture = add_unique_name(&texture_names, png_filename);
+		array_push(records, record);
+	}
+	fclose(file);
+
+	if (is_valid) {
+		load_textures((const char**)texture_names, array_length(texture_names));
+
+		mesh_t** meshes = (mesh_t**)malloc(sizeof(mesh_t*) * (array_length(mesh_names) + 1));
+		for (int i = 0; i < array_length(mesh_names); i++) {
+			meshes[i] = load_mesh(mesh_names[i]);
+		}
+
+		transform_t* transforms = NULL;
+		for (int i = 0; i < array_length(records); i++) {
+			scene_record_t* record = &records[i];
+
+			array_clear(transforms);
+			for (int z = 0; z < record->count[2]; z++) {
+				for (int y = 0; y < record->count[1]; y++) {
+					for (int x = 0; x < record->count[0]; x++) {
+						transform_t transform = {
+							.scale = record->scale,
+							.rotation = record->rotation,
+							.translation = vec3_new(
+								record->translation.x + x * record->spacing.x,
+								record->translation.y + y * record->spacing.y,
+								record->translation.z + z * record->spacing.z
+							)
+						};
+						array_push(transforms, transform);
+					}
+				}
+			}
+			add_instances(meshes[record->mesh], load_texture(texture_names[record->texture]), transforms, array_length(transforms));
+		}
+		array_free(transforms);
+		free(meshes);
+	}
+
+	free_names(texture_names);
+	free_names(mesh_names);
+	array_free(records);
+	return is_valid;
+}
+
+int add_object(mesh_t* mesh, upng_t* texture, vec3_t scale, vec3_t translation, vec3_t rotation) {
+	object_t object = {
+		.mesh = mesh,
+		.texture = texture,
+		.scale = scale,
+		.rotation = rotation,
+		.translation = translation,
+		.lod = 0
+	};
+	array_push(objects, object);
+	return array_length(objects) - 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Place count copies of a mesh at once. The instances only own their transform
+// and level of detail, the geometry and the texture are shared, so drawing them
+// costs the vertex transform and the visible faces of every instance. They get
+// consecutive object indices, the first one is returned.
+///////////////////////////////////////////////////////////////////////////////
+int add_instances(mesh_t* mesh, upng_t* texture, const transform_t* transforms, int count) {
+	int first_object = array_length(objects);
+	for (int i = 0; i < count; i++) {
+		add_object(mesh, texture, transforms[i].scale, transforms[i].translation, transforms[i].rotation);
+	}
+	return first_object;
+}
+
+int get_num_objects(void) {
+	return array_length(objects);
+}
+
+object_t* get_object(int index) {
+	if (index < 0 || index >= array_length(objects)) {
+		return NULL;
+	}
+	return &objects[index];
+}
+
+void free_scene(void) {
+	array_free(objects);
+	objects = NULL;
+}
@@ -0,0 +1,36 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "mesh.h"
+#include "upng.h"
+
+// A placed copy of a mesh. Objects share the mesh and the texture they use,
+// only the transform and the selected level of detail are their own.
+typedef struct {
+	mesh_t* mesh;
+	upng_t* texture;
+	vec3_t scale;
+	vec3_t rotation;
+	vec3_t translation;
+	int lod;
+} object_t;
+
+// Placement of one instance, see add_instances
+typedef struct {
+	vec3_t scale;
+	vec3_t rotation;
+	vec3_t translation;
+} transform_t;
+
+bool load_scene(const char* filename);
+int add_object(mesh_t* mesh, upng_t* texture, vec3_t scale, vec3_t translation, vec3_t rotation);
+int add_instances(mesh_t* mesh, upng_t* texture, const transform_t* transforms, int count);
+
+int get_num_objects(void);
+object_t* get_object(int index);
+
+void free_scene(void);
+
+#endif
@@ -1,7 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
 #include "texture.h"
+#include "array.h"
+#include "job.h"
+#include "file_map.h"
+
+// The texels start on a cache line
+#define TEXTURE_ALIGNMENT 64
 
 tex2_t tex2_clone(tex2_t* t)
 {
 	tex2_t result = { t->u, t->v };
 	return result;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// Texture store: textures are shared by file name, so every PNG is decoded
+// once however many objects use it
+///////////////////////////////////////////////////////////////////////////////
+typedef struct {
+	char filename[FILENAME_MAX];
+	upng_t* texture;
+	unsigned char* texels; // decoded image, returned by upng_get_buffer
+} texture_entry_t;
+
+static texture_entry_t* textures = NULL;
+
+// Inflate memory of every job thread, reused by all the textures of a batch
+static upng_scratch decode_scratch[MAX_JOB_THREADS];
+
+static unsigned char* alloc_texels(size_t size) {
+#ifdef _WIN32
+	return (unsigned char*)_aligned_malloc(size, TEXTURE_ALIGNMENT);
+#else
+	void* texels = NULL;
+	return posix_memalign(&texels, TEXTURE_ALIGNMENT, size) == 0 ? (unsigned char*)texels : NULL;
+#endif
+}
+
+static void free_texels(unsigned char* texels) {
+#ifdef _WIN32
+	_aligned_free(texels);
+#else
+	free(texels);
+#endif
+}
+
+static int find_texture(const char* png_filename) {
+	for (int i = 0; i < array_length(textures); i++) {
+		if (strcmp(textures[i].filename, png_filename) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool decode_texture(texture_entry_t* entry, upng_t* png_image, upng_scratch* scratch) {
+	if (upng_header(png_image) != UPNG_EOK) {
+		return false;
+	}
+
+	unsigned long size = (upng_get_width(png_image) * upng_get_height(png_image) * upng_get_bpp(png_image) + 7) / 8;
+	entry->texels = alloc_texels(size);
+	if (!entry->texels) {
+		return false;
+	}
+
+	if (upng_decode_into(png_image, entry->texels, size, scratch) != UPNG_EOK) {
+		free_texels(entry->texels);
+		entry->texels = NULL;
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decode a PNG from the mapped file straight into its final texel memory. The
+// only other memory used is the scratch of the thread, so the file isn't
+// copied and the filtered scanlines don't need an allocation of their own.
+///////////////////////////////////////////////////////////////////////////////
+static void decode_texture_job(void* data, int index, int thread_index) {
+	texture_entry_t* entry = &textures[*(int*)data + index];
+
+	file_map_t map;
+	if (map_file(&map, entry->filename)) {
+		upng_t* png_image = upng_new_from_bytes((const unsigned char*)map.data, (unsigned long)map.size);
+		if (png_image != NULL) {
+			if (decode_texture(entry, png_image, &decode_scratch[thread_index])) {
+				entry->texture = png_image;
+			}
+			else {
+				upng_free(png_image);
+			}
+		}
+		unmap_file(&map);
+	}
+
+	if (!entry->texture) {
+		fprintf(stderr, "Error loading the texture %s\n", entry->filename);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Load the textures that aren't in the store yet, decoding them in parallel
+// on the job system. Textures that fail to load are kept as NULL.
+///////////////////////////////////////////////////////////////////////////////
+void load_textures(const char** png_filenames, int count) {
+	int first_new = array_length(textures);
+	for (int i = 0; i < count; i++) {
+		if (find_texture(png_filenames[i]) < 0) {
+			texture_entry_t entry = { .texture = NULL, .texels = NULL };
+			snprintf(entry.filename, sizeof(entry.filename), "%s", png_filenames[i]);
+			array_push(textures, entry);
+		}
+	}
+
+	run_jobs(decode_texture_job, &first_new, array_length(textures) - first_new);
+
+	for (int i = 0; i < MAX_JOB_THREADS; i++) {
+		upng_free_scratch(&decode_scratch[i]);
+	}
+}
+
+upng_t* load_texture(const char* png_filename) {
+	load_textures(&png_filename, 1);
+	return textures[find_texture(png_filename)].texture;
+}
+
+void free_textures(void) {
+	for (int i = 0; i < array_length(textures); i++) {
+		if (textures[i].texture) {
+			upng_free(textures[i].texture);
+		}
+		free_texels(textures[i].texels);
+	}
+	array_free(textures);
+	textures = NULL;
+}
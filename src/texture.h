@@ -2,6 +2,7 @@
 #define TEXTURE_H
 
 #include <stdint.h>
+#include "upng.h"
 
 typedef struct {
 	float u;
@@ -10,4 +11,8 @@ typedef struct {
 
 tex2_t tex2_clone(tex2_t* t);
 
-#endif
\ No newline at end of file
+upng_t* load_texture(const char* png_filename);
+void load_textures(const char** png_filenames, int count);
+void free_textures(void);
+
+#endif
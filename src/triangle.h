@@ -6,14 +6,12 @@
 #include "texture.h"
 #include "upng.h"
 
+// A face indexes three mesh vertices; every vertex has its own position and
+// texture coordinate, so corners sharing both share the vertex
 typedef struct {
 	int a;
 	int b;
 	int c;
-	tex2_t a_uv;
-	tex2_t b_uv;
-	tex2_t c_uv;
-	uint32_t color;
 } face_t;
 
 typedef struct {
@@ -21,6 +19,7 @@ typedef struct {
 	tex2_t texcoords[3];
 	uint32_t color;
 	upng_t* texture;
+	int object_index;
 } triangle_t;
 
 vec3_t get_triangle_normal(vec4_t vertices[3]);
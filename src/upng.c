@@ -28,9 +28,16 @@ freely, subject to the following restrictions:
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "upng.h"
 
+/* SSE2 is part of every x64 target, 32-bit builds need it enabled explicitly */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UPNG_SSE2
+#include <emmintrin.h>
+#endif
+
 #define MAKE_BYTE(b) ((b) & 0xFF)
 #define MAKE_DWORD(a,b,c,d) ((MAKE_BYTE(a) << 24) | (MAKE_BYTE(b) << 16) | (MAKE_BYTE(c) << 8) | MAKE_BYTE(d))
 #define MAKE_DWORD_PTR(p) MAKE_DWORD((p)[0], (p)[1], (p)[2], (p)[3])
@@ -47,14 +54,11 @@ freely, subject to the following restrictions:
 #define NUM_CODE_LENGTH_CODES 19	/*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros */
 #define MAX_SYMBOLS 288 /* largest number of symbols used by any tree type */
 
-#define DEFLATE_CODE_BITLEN 15
-#define DISTANCE_BITLEN 15
-#define CODE_LENGTH_BITLEN 7
 #define MAX_BIT_LENGTH 15 /* largest bitlen used by any tree type */
-
-#define DEFLATE_CODE_BUFFER_SIZE (NUM_DEFLATE_CODE_SYMBOLS * 2)
-#define DISTANCE_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
-#define CODE_LENGTH_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
+#define HUFFMAN_FAST_BITS 10 /* codes up to this length are decoded with a single table lookup */
+#define INFLATE_WINDOW_SIZE 32768 /* farthest distance a match reaches back */
+#define INFLATE_MATCH_ROOM 266 /* longest match, plus the bytes copy_match may spill over */
+#define INFLATE_FLUSH_SIZE 65536 /* room left in the window after unfiltering the scanlines in it */
 
 #define SET_ERROR(upng,code) do { (upng)->error = (code); (upng)->error_line = __LINE__; } while (0)
 
@@ -92,6 +96,7 @@ struct upng_t {
 
 	unsigned char*	buffer;
 	unsigned long	size;
+	char			buffer_owning;	/*0 when the buffer was given to upng_decode_into */
 
 	upng_error		error;
 	unsigned		error_line;
@@ -100,11 +105,50 @@ struct upng_t {
 	upng_source		source;
 };
 
-typedef struct huffman_tree {
-	unsigned* tree2d;
-	unsigned maxbitlen;	/*maximum number of bits a single code can get */
-	unsigned numcodes;	/*number of symbols in the alphabet = number of codes */
-} huffman_tree;
+/*bit reader over the deflate stream, read straight from the IDAT chunks of the source. The bits are
+  consumed from the lowest bit of a 64-bit buffer, which is refilled a whole word at a time, so a length
+  and a distance with all their extra bits (48 bits at most) are decoded with a single refill. Past the
+  end of the last chunk zeros are loaded, reading them is detected with bits_overrun */
+typedef struct bit_reader {
+	const unsigned char* in;	/*data of the current IDAT chunk */
+	unsigned long inlength;
+	unsigned long next;	/*next byte to load into the buffer */
+	uint64_t buffer;
+	unsigned count;	/*number of valid bits in the buffer */
+	const unsigned char* chunk;	/*chunk following the current one */
+	const unsigned char* end;	/*end of the source */
+	unsigned long padding;	/*number of zero bytes loaded past the last chunk */
+} bit_reader;
+
+/*the inflated, still filtered scanlines go through a window: when it is full the complete scanlines
+  are unfiltered into the image and only the last 32KB (as far as a match reaches back) and the
+  incomplete scanline are kept, so the whole filtered image never has to be in memory at once */
+typedef struct inflate_output {
+	unsigned char* window;
+	unsigned long size;	/*size of the window */
+	unsigned long pos;	/*write position in the window */
+	unsigned long end;	/*writes going past this position call grow_output first */
+	unsigned long total;	/*bytes inflated before the start of the window */
+	unsigned long limit;	/*the inflated data must stay below this size */
+	unsigned long row;	/*window position of the first scanline not unfiltered yet */
+	unsigned char* image;	/*the unfiltered scanlines */
+	unsigned long linebytes;
+	unsigned long bytewidth;
+	unsigned y, h;	/*next scanline to unfilter, number of scanlines */
+} inflate_output;
+
+/*the decoding tables of a canonical Huffman code. Codes up to HUFFMAN_FAST_BITS long are found
+  with a single lookup of the next bits of the stream, the longer (and rarer) ones by comparing
+  them with the last code of every length */
+typedef struct huffman_table {
+	unsigned short fast[1 << HUFFMAN_FAST_BITS];	/*symbol << 4 | code length, 0 when the code is longer */
+	unsigned first_code[MAX_BIT_LENGTH + 1];	/*first code of every length */
+	unsigned first_symbol[MAX_BIT_LENGTH + 1];	/*index in symbols of the first code of every length */
+	unsigned max_code[MAX_BIT_LENGTH + 1];	/*end of the codes of every length, left aligned to 16 bits */
+	unsigned short symbols[MAX_SYMBOLS];	/*the symbols, sorted by code */
+} huffman_table;
+
+static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length);
 
 static const unsigned LENGTH_BASE[29] = {	/*the base lengths represented by codes 257-285 */
 	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
@@ -129,173 +173,223 @@ static const unsigned DISTANCE_EXTRA[30] = {	/*the extra bits of backwards dista
 static const unsigned CLCL[NUM_CODE_LENGTH_CODES]	/*the order in which "code length alphabet code lengths" are stored, out of this the huffman tree of the dynamic huffman tree lengths is generated */
 = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
 
-static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
-	289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0, 1,
-	2, 3, 298, 299, 4, 5, 6, 7, 301, 304, 302, 303, 8, 9, 10, 11, 305, 306, 12,
-	13, 14, 15, 308, 339, 309, 324, 310, 317, 311, 314, 312, 313, 16, 17, 18,
-	19, 315, 316, 20, 21, 22, 23, 318, 321, 319, 320, 24, 25, 26, 27, 322, 323,
-	28, 29, 30, 31, 325, 332, 326, 329, 327, 328, 32, 33, 34, 35, 330, 331, 36,
-	37, 38, 39, 333, 336, 334, 335, 40, 41, 42, 43, 337, 338, 44, 45, 46, 47,
-	340, 355, 341, 348, 342, 345, 343, 344, 48, 49, 50, 51, 346, 347, 52, 53,
-	54, 55, 349, 352, 350, 351, 56, 57, 58, 59, 353, 354, 60, 61, 62, 63, 356,
-	363, 357, 360, 358, 359, 64, 65, 66, 67, 361, 362, 68, 69, 70, 71, 364,
-	367, 365, 366, 72, 73, 74, 75, 368, 369, 76, 77, 78, 79, 371, 434, 372,
-	403, 373, 388, 374, 381, 375, 378, 376, 377, 80, 81, 82, 83, 379, 380, 84,
-	85, 86, 87, 382, 385, 383, 384, 88, 89, 90, 91, 386, 387, 92, 93, 94, 95,
-	389, 396, 390, 393, 391, 392, 96, 97, 98, 99, 394, 395, 100, 101, 102, 103,
-	397, 400, 398, 399, 104, 105, 106, 107, 401, 402, 108, 109, 110, 111, 404,
-	419, 405, 412, 406, 409, 407, 408, 112, 113, 114, 115, 410, 411, 116, 117,
-	118, 119, 413, 416, 414, 415, 120, 121, 122, 123, 417, 418, 124, 125, 126,
-	127, 420, 427, 421, 424, 422, 423, 128, 129, 130, 131, 425, 426, 132, 133,
-	134, 135, 428, 431, 429, 430, 136, 137, 138, 139, 432, 433, 140, 141, 142,
-	143, 435, 483, 436, 452, 568, 437, 438, 445, 439, 442, 440, 441, 144, 145,
-	146, 147, 443, 444, 148, 149, 150, 151, 446, 449, 447, 448, 152, 153, 154,
-	155, 450, 451, 156, 157, 158, 159, 453, 468, 454, 461, 455, 458, 456, 457,
-	160, 161, 162, 163, 459, 460, 164, 165, 166, 167, 462, 465, 463, 464, 168,
-	169, 170, 171, 466, 467, 172, 173, 174, 175, 469, 476, 470, 473, 471, 472,
-	176, 177, 178, 179, 474, 475, 180, 181, 182, 183, 477, 480, 478, 479, 184,
-	185, 186, 187, 481, 482, 188, 189, 190, 191, 484, 515, 485, 500, 486, 493,
-	487, 490, 488, 489, 192, 193, 194, 195, 491, 492, 196, 197, 198, 199, 494,
-	497, 495, 496, 200, 201, 202, 203, 498, 499, 204, 205, 206, 207, 501, 508,
-	502, 505, 503, 504, 208, 209, 210, 211, 506, 507, 212, 213, 214, 215, 509,
-	512, 510, 511, 216, 217, 218, 219, 513, 514, 220, 221, 222, 223, 516, 531,
-	517, 524, 518, 521, 519, 520, 224, 225, 226, 227, 522, 523, 228, 229, 230,
-	231, 525, 528, 526, 527, 232, 233, 234, 235, 529, 530, 236, 237, 238, 239,
-	532, 539, 533, 536, 534, 535, 240, 241, 242, 243, 537, 538, 244, 245, 246,
-	247, 540, 543, 541, 542, 248, 249, 250, 251, 544, 545, 252, 253, 254, 255,
-	547, 554, 548, 551, 549, 550, 256, 257, 258, 259, 552, 553, 260, 261, 262,
-	263, 555, 558, 556, 557, 264, 265, 266, 267, 559, 560, 268, 269, 270, 271,
-	562, 565, 563, 564, 272, 273, 274, 275, 566, 567, 276, 277, 278, 279, 569,
-	572, 570, 571, 280, 281, 282, 283, 573, 574, 284, 285, 286, 287, 0, 0
-};
+static uint64_t load_le64(const unsigned char* p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
 
-static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
-	33, 48, 34, 41, 35, 38, 36, 37, 0, 1, 2, 3, 39, 40, 4, 5, 6, 7, 42, 45, 43,
-	44, 8, 9, 10, 11, 46, 47, 12, 13, 14, 15, 49, 56, 50, 53, 51, 52, 16, 17,
-	18, 19, 54, 55, 20, 21, 22, 23, 57, 60, 58, 59, 24, 25, 26, 27, 61, 62, 28,
-	29, 30, 31, 0, 0
-};
+/*read the data of the IDAT chunks from chunk on, the chunks up to end must have been validated */
+static void bit_reader_init(bit_reader* reader, const unsigned char* chunk, const unsigned char* end)
+{
+	reader->in = NULL;
+	reader->inlength = 0;
+	reader->next = 0;
+	reader->buffer = 0;
+	reader->count = 0;
+	reader->chunk = chunk;
+	reader->end = end;
+	reader->padding = 0;
+}
 
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+/*move on to the data of the next IDAT chunk, returns 0 when there is none left */
+static int next_idat_chunk(bit_reader* reader)
 {
-	unsigned char result = (unsigned char)((bitstream[(*bitpointer) >> 3] >> ((*bitpointer) & 0x7)) & 1);
-	(*bitpointer)++;
-	return result;
+	while (reader->chunk < reader->end && upng_chunk_type(reader->chunk) != CHUNK_IEND) {
+		const unsigned char* chunk = reader->chunk;
+
+		reader->chunk += upng_chunk_length(chunk) + 12;
+		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
+			reader->in = chunk + 8;
+			reader->inlength = upng_chunk_length(chunk);
+			reader->next = 0;
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
-static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream, unsigned long nbits)
+/*fill the buffer up to at least 56 bits */
+static void refill_bits(bit_reader* reader)
 {
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
-		result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
-	return result;
+	if (reader->next + 8 <= reader->inlength) {
+		/*load a whole word; the bytes that don't fit are loaded again by the next refill, they
+		  land on the same bits of the buffer */
+		reader->buffer |= load_le64(reader->in + reader->next) << reader->count;
+		reader->next += (63 - reader->count) >> 3;
+		reader->count |= 56;
+	} else {
+		/*byte by byte near the end of a chunk, the stream continues in the next one */
+		while (reader->count <= 56) {
+			uint64_t byte = 0;
+			while (reader->next >= reader->inlength && next_idat_chunk(reader)) {
+				/*skip empty chunks */
+			}
+			if (reader->next < reader->inlength) {
+				byte = reader->in[reader->next++];
+			} else {
+				reader->padding++;
+			}
+			reader->buffer |= byte << reader->count;
+			reader->count += 8;
+		}
+	}
 }
 
-/* the buffer must be numcodes*2 in size! */
-static void huffman_tree_init(huffman_tree* tree, unsigned* buffer, unsigned numcodes, unsigned maxbitlen)
+static void consume_bits(bit_reader* reader, unsigned nbits)
 {
-	tree->tree2d = buffer;
+	reader->buffer >>= nbits;
+	reader->count -= nbits;
+}
 
-	tree->numcodes = numcodes;
-	tree->maxbitlen = maxbitlen;
+static unsigned read_bits(bit_reader* reader, unsigned nbits)
+{
+	unsigned result;
+	if (reader->count < nbits) {
+		refill_bits(reader);
+	}
+	result = (unsigned)reader->buffer & ((1u << nbits) - 1);
+	consume_bits(reader, nbits);
+	return result;
 }
 
-/*given the code lengths (as stored in the PNG file), generate the tree as defined by Deflate. maxbitlen is the maximum bits that a code in the tree can have. return value is error.*/
-static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree, const unsigned *bitlen)
+/*true once bits past the end of the input have been read */
+static int bits_overrun(const bit_reader* reader)
 {
-	unsigned tree1d[MAX_SYMBOLS];
-	unsigned blcount[MAX_BIT_LENGTH];
-	unsigned nextcode[MAX_BIT_LENGTH+1];
-	unsigned bits, n, i;
-	unsigned nodefilled = 0;	/*up to which node it is filled */
-	unsigned treepos = 0;	/*position in the tree (1 of the numcodes columns) */
-
-	/* initialize local vectors */
-	memset(blcount, 0, sizeof(blcount));
-	memset(nextcode, 0, sizeof(nextcode));
+	return reader->padding * 8 > reader->count;
+}
 
-	/*step 1: count number of instances of each code length */
-	for (bits = 0; bits < tree->numcodes; bits++) {
-		blcount[bitlen[bits]]++;
+/*copy length whole bytes of the input, the reader must be at a byte boundary. Returns 0 when the input ends first*/
+static int read_bytes(bit_reader* reader, unsigned char* out, unsigned long length)
+{
+	/* the bytes left in the bit buffer come first */
+	while (length > 0 && reader->count > 0) {
+		*out++ = (unsigned char)reader->buffer;
+		consume_bits(reader, 8);
+		length--;
+	}
+	if (bits_overrun(reader)) {
+		return 0;
 	}
 
-	/*step 2: generate the nextcode values */
-	for (bits = 1; bits <= tree->maxbitlen; bits++) {
-		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+	/* then straight from the chunks, the rest of the buffer holds bytes loaded again later */
+	if (length > 0) {
+		reader->buffer = 0;
 	}
+	while (length > 0) {
+		unsigned long n;
 
-	/*step 3: generate all the codes */
-	for (n = 0; n < tree->numcodes; n++) {
-		if (bitlen[n] != 0) {
-			tree1d[n] = nextcode[bitlen[n]]++;
+		if (reader->next >= reader->inlength && !next_idat_chunk(reader)) {
+			return 0;
 		}
+
+		n = reader->inlength - reader->next;
+		if (n > length) {
+			n = length;
+		}
+		memcpy(out, reader->in + reader->next, n);
+		reader->next += n;
+		out += n;
+		length -= n;
 	}
 
-	/*convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means uninited, a value >= numcodes is an address to another bit, a value < numcodes is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as many columns as codes - 1
-	   a good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes. Here, the internal nodes are stored (what their 0 and 1 option point to). There is only memory for such good tree currently, if there are more nodes (due to too long length codes), error 55 will happen */
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		tree->tree2d[n] = 32767;	/*32767 here means the tree2d isn't filled there yet */
+	return 1;
+}
+
+static unsigned reverse_bits(unsigned code, unsigned length)
+{
+	unsigned result = 0, i;
+	for (i = 0; i < length; i++) {
+		result = (result << 1) | (code & 1);
+		code >>= 1;
 	}
+	return result;
+}
 
-	for (n = 0; n < tree->numcodes; n++) {	/*the codes */
-		for (i = 0; i < bitlen[n]; i++) {	/*the bits for this code */
-			unsigned char bit = (unsigned char)((tree1d[n] >> (bitlen[n] - i - 1)) & 1);
-			/* check if oversubscribed */
-			if (treepos > tree->numcodes - 2) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
+/*given the code lengths (as stored in the PNG file), build the decoding tables of the canonical code defined by Deflate. An oversubscribed set of lengths is an error, an incomplete one is allowed (its unused codes fail to decode).*/
+static void huffman_table_create_lengths(upng_t* upng, huffman_table* table, const unsigned *bitlen, unsigned numcodes)
+{
+	unsigned blcount[MAX_BIT_LENGTH + 1];
+	unsigned nextcode[MAX_BIT_LENGTH + 1];
+	unsigned code = 0, symbol = 0, bits, n;
 
-			if (tree->tree2d[2 * treepos + bit] == 32767) {	/*not yet filled in */
-				if (i + 1 == bitlen[n]) {	/*last bit */
-					tree->tree2d[2 * treepos + bit] = n;	/*put the current code in it */
-					treepos = 0;
-				} else {	/*put address of the next step in here, first that address has to be found of course (it's just nodefilled + 1)... */
-					nodefilled++;
-					tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;	/*addresses encoded with numcodes added to it */
-					treepos = nodefilled;
-				}
-			} else {
-				treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
-			}
+	memset(blcount, 0, sizeof(blcount));
+	memset(table->fast, 0, sizeof(table->fast));
+
+	/*step 1: count number of instances of each code length */
+	for (n = 0; n < numcodes; n++) {
+		blcount[bitlen[n]]++;
+	}
+
+	/*step 2: generate the first code of every length; the codes of a length must fit its bits */
+	for (bits = 1; bits <= MAX_BIT_LENGTH; bits++) {
+		nextcode[bits] = code;
+		table->first_code[bits] = code;
+		table->first_symbol[bits] = symbol;
+		code += blcount[bits];
+		if (code > (1u << bits)) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
 		}
+		table->max_code[bits] = code << (16 - bits);
+		code <<= 1;
+		symbol += blcount[bits];
 	}
 
-	for (n = 0; n < tree->numcodes * 2; n++) {
-		if (tree->tree2d[n] == 32767) {
-			tree->tree2d[n] = 0;	/*remove possible remaining 32767's */
+	/*step 3: assign the codes. The stream holds a code starting from its highest bit, so a short code fills every fast entry starting with its reversed bits */
+	for (n = 0; n < numcodes; n++) {
+		unsigned length = bitlen[n];
+		if (length == 0) {
+			continue;
+		}
+
+		code = nextcode[length]++;
+		table->symbols[table->first_symbol[length] + code - table->first_code[length]] = (unsigned short)n;
+
+		if (length <= HUFFMAN_FAST_BITS) {
+			unsigned entry = (n << 4) | length;
+			for (bits = reverse_bits(code, length); bits < (1u << HUFFMAN_FAST_BITS); bits += 1u << length) {
+				table->fast[bits] = (unsigned short)entry;
+			}
 		}
 	}
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in, unsigned long *bp, const huffman_tree* codetree, unsigned long inlength)
+static unsigned huffman_decode_symbol(upng_t *upng, bit_reader* reader, const huffman_table* table)
 {
-	unsigned treepos = 0, ct;
-	unsigned char bit;
-	for (;;) {
-		/* error: end of input memory reached without endcode */
-		if (((*bp) & 0x07) == 0 && ((*bp) >> 3) > inlength) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return 0;
-		}
+	unsigned entry, code, length;
 
-		bit = read_bit(bp, in);
+	if (reader->count < MAX_BIT_LENGTH) {
+		refill_bits(reader);
+	}
 
-		ct = codetree->tree2d[(treepos << 1) | bit];
-		if (ct < codetree->numcodes) {
-			return ct;
-		}
+	entry = table->fast[reader->buffer & ((1u << HUFFMAN_FAST_BITS) - 1)];
+	if (entry != 0) {
+		consume_bits(reader, entry & 15);
+		return entry >> 4;
+	}
 
-		treepos = ct - codetree->numcodes;
-		if (treepos >= codetree->numcodes) {
-			SET_ERROR(upng, UPNG_EMALFORMED);
-			return 0;
+	/*a longer code: left align it (first bit highest) and find the first length it comes before the end of */
+	code = reverse_bits((unsigned)reader->buffer & 0xFFFF, 16);
+	for (length = HUFFMAN_FAST_BITS + 1; length <= MAX_BIT_LENGTH; length++) {
+		if (code < table->max_code[length]) {
+			break;
 		}
 	}
+
+	/* error: the bits are not a code of the table */
+	if (length > MAX_BIT_LENGTH) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	consume_bits(reader, length);
+	return table->symbols[table->first_symbol[length] + (code >> (16 - length)) - table->first_code[length]];
 }
 
 /* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffman_tree* codetreeD, huffman_tree* codelengthcodetree, const unsigned char *in, unsigned long *bp, unsigned long inlength)
+static void get_tree_inflate_dynamic(upng_t* upng, huffman_table* codetree, huffman_table* codetreeD, huffman_table* codelengthcodetree, bit_reader* reader)
 {
 	unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
 	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
@@ -303,30 +397,29 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	unsigned n, hlit, hdist, hclen, i;
 
 	/*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated */
-	/*C-code note: use no "return" between ctor and dtor of an uivector! */
-	if ((*bp) >> 3 >= inlength - 2) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
-
 	/* clear bitlen arrays */
 	memset(bitlen, 0, sizeof(bitlen));
 	memset(bitlenD, 0, sizeof(bitlenD));
 
 	/*the bit pointer is or will go past the memory */
-	hlit = read_bits(bp, in, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
-	hdist = read_bits(bp, in, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
-	hclen = read_bits(bp, in, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
+	hlit = read_bits(reader, 5) + 257;	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
+	hdist = read_bits(reader, 5) + 1;	/*number of distance codes. Unlike the spec, the value 1 is added to it here already */
+	hclen = read_bits(reader, 4) + 4;	/*number of code length codes. Unlike the spec, the value 4 is added to it here already */
 
 	for (i = 0; i < NUM_CODE_LENGTH_CODES; i++) {
 		if (i < hclen) {
-			codelengthcode[CLCL[i]] = read_bits(bp, in, 3);
+			codelengthcode[CLCL[i]] = read_bits(reader, 3);
 		} else {
 			codelengthcode[CLCL[i]] = 0;	/*if not, it must stay 0 */
 		}
 	}
 
-	huffman_tree_create_lengths(upng, codelengthcodetree, codelengthcode);
+	if (bits_overrun(reader)) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return;
+	}
+
+	huffman_table_create_lengths(upng, codelengthcodetree, codelengthcode, NUM_CODE_LENGTH_CODES);
 
 	/* bail now if we encountered an error earlier */
 	if (upng->error != UPNG_EOK) {
@@ -336,7 +429,7 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	/*now we can use this tree to read the lengths for the tree that this function will return */
 	i = 0;
 	while (i < hlit + hdist) {	/*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
-		unsigned code = huffman_decode_symbol(upng, in, bp, codelengthcodetree, inlength);
+		unsigned code = huffman_decode_symbol(upng, reader, codelengthcodetree);
 		if (upng->error != UPNG_EOK) {
 			break;
 		}
@@ -352,12 +445,12 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			unsigned replength = 3;	/*read in the 2 bits that indicate repeat length (3-6) */
 			unsigned value;	/*set value to the previous code */
 
-			if ((*bp) >> 3 >= inlength) {
+			if (bits_overrun(reader)) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				break;
 			}
 			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 2);
+			replength += read_bits(reader, 2);
 
 			if ((i - 1) < hlit) {
 				value = bitlen[i - 1];
@@ -382,13 +475,13 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 			}
 		} else if (code == 17) {	/*repeat "0" 3-10 times */
 			unsigned replength = 3;	/*read in the bits that indicate repeat length */
-			if ((*bp) >> 3 >= inlength) {
+			if (bits_overrun(reader)) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				break;
 			}
 
 			/*error, bit pointer jumps past memory */
-			replength += read_bits(bp, in, 3);
+			replength += read_bits(reader, 3);
 
 			/*repeat this value in the next lengths */
 			for (n = 0; n < replength; n++) {
@@ -408,12 +501,12 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 		} else if (code == 18) {	/*repeat "0" 11-138 times */
 			unsigned replength = 11;	/*read in the bits that indicate repeat length */
 			/* error, bit pointer jumps past memory */
-			if ((*bp) >> 3 >= inlength) {
+			if (bits_overrun(reader)) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				break;
 			}
 
-			replength += read_bits(bp, in, 7);
+			replength += read_bits(reader, 7);
 
 			/*repeat this value in the next lengths */
 			for (n = 0; n < replength; n++) {
@@ -442,74 +535,152 @@ static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree, huffm
 	/*the length of the end code 256 must be larger than 0 */
 	/*now we've finally got hlit and hdist, so generate the code trees, and the function is done */
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetree, bitlen);
+		huffman_table_create_lengths(upng, codetree, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
 	}
 	if (upng->error == UPNG_EOK) {
-		huffman_tree_create_lengths(upng, codetreeD, bitlenD);
+		huffman_table_create_lengths(upng, codetreeD, bitlenD, NUM_DISTANCE_SYMBOLS);
 	}
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength, unsigned btype)
+/*the lengths of the fixed Huffman codes of block type 1*/
+static void get_tree_inflate_fixed(upng_t* upng, huffman_table* codetree, huffman_table* codetreeD)
 {
-	unsigned codetree_buffer[DEFLATE_CODE_BUFFER_SIZE];
-	unsigned codetreeD_buffer[DISTANCE_BUFFER_SIZE];
-	unsigned done = 0;
+	unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
+	unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
+	unsigned i;
+
+	for (i = 0; i < NUM_DEFLATE_CODE_SYMBOLS; i++) {
+		bitlen[i] = i <= 143 ? 8 : i <= 255 ? 9 : i <= 279 ? 7 : 8;
+	}
+	for (i = 0; i < NUM_DISTANCE_SYMBOLS; i++) {
+		bitlenD[i] = 5;
+	}
+
+	huffman_table_create_lengths(upng, codetree, bitlen, NUM_DEFLATE_CODE_SYMBOLS);
+	huffman_table_create_lengths(upng, codetreeD, bitlenD, NUM_DISTANCE_SYMBOLS);
+}
+
+/*copy length bytes from distance bytes back in the output. The source may overlap the bytes being written, which repeats the last distance bytes.*/
+static void copy_match(unsigned char* out, unsigned long outsize, unsigned long pos, unsigned long distance, unsigned long length)
+{
+	unsigned char* dest = out + pos;
+	const unsigned char* src = dest - distance;
+	unsigned long i;
+
+	if (distance >= 8 && outsize - pos - length >= 8) {
+		/*8 bytes at a time: the chunks don't overlap, and the last one may spill over into the room left at the end of the output */
+		for (i = 0; i < length; i += 8) {
+			memcpy(dest + i, src + i, 8);
+		}
+	} else if (distance == 1) {
+		memset(dest, src[0], length);
+	} else {
+		for (i = 0; i < length; i++) {
+			dest[i] = src[i];
+		}
+	}
+}
+
+/*unfilter the complete scanlines of the window into the image, then move what is still needed to its start*/
+static void flush_scanlines(upng_t* upng, inflate_output* output)
+{
+	unsigned long keep;
 
-	huffman_tree codetree;
-	huffman_tree codetreeD;
+	while (output->y < output->h && output->pos - output->row >= output->linebytes + 1) {
+		unsigned char* recon = output->image + output->y * output->linebytes;
+		const unsigned char* precon = output->y > 0 ? recon - output->linebytes : NULL;
+
+		unfilter_scanline(upng, recon, output->window + output->row + 1, precon, output->bytewidth, output->window[output->row], output->linebytes);
+		if (upng->error != UPNG_EOK) {
+			return;
+		}
+
+		output->row += output->linebytes + 1;
+		output->y++;
+	}
+
+	/* data after the last scanline is dropped */
+	if (output->y == output->h) {
+		output->row = output->pos;
+	}
+
+	/* keep the bytes a match can still reach back to, and the incomplete scanline */
+	keep = output->pos > INFLATE_WINDOW_SIZE ? output->pos - INFLATE_WINDOW_SIZE : 0;
+	if (keep > output->row) {
+		keep = output->row;
+	}
+	if (keep > 0) {
+		memmove(output->window, output->window + keep, output->pos - keep);
+		output->pos -= keep;
+		output->row -= keep;
+		output->total += keep;
+	}
+
+	output->end = output->size - INFLATE_MATCH_ROOM;
+	if (output->end > output->limit - output->total) {
+		output->end = output->limit - output->total;
+	}
+}
+
+/*called before length bytes go past output->end: fails when the inflated data would grow past its limit, otherwise makes room in the window*/
+static int grow_output(upng_t* upng, inflate_output* output, unsigned long length)
+{
+	if (output->total + output->pos + length >= output->limit) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return 0;
+	}
+
+	flush_scanlines(upng, output);
+	return upng->error == UPNG_EOK;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree*/
+static void inflate_huffman(upng_t* upng, inflate_output* output, bit_reader* reader, unsigned btype)
+{
+	huffman_table codetree;
+	huffman_table codetreeD;
 
 	if (btype == 1) {
 		/* fixed trees */
-		huffman_tree_init(&codetree, (unsigned*)FIXED_DEFLATE_CODE_TREE, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, (unsigned*)FIXED_DISTANCE_TREE, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
+		get_tree_inflate_fixed(upng, &codetree, &codetreeD);
 	} else if (btype == 2) {
 		/* dynamic trees */
-		unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
-		huffman_tree codelengthcodetree;
+		huffman_table codelengthcodetree;
+		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, reader);
+	}
 
-		huffman_tree_init(&codetree, codetree_buffer, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-		huffman_tree_init(&codetreeD, codetreeD_buffer, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-		huffman_tree_init(&codelengthcodetree, codelengthcodetree_buffer, NUM_CODE_LENGTH_CODES, CODE_LENGTH_BITLEN);
-		get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, in, bp, inlength);
+	if (upng->error != UPNG_EOK) {
+		return;
 	}
 
-	while (done == 0) {
-		unsigned code = huffman_decode_symbol(upng, in, bp, &codetree, inlength);
+	for (;;) {
+		unsigned code;
+
+		/* one refill holds a length and a distance code with their extra bits */
+		refill_bits(reader);
+
+		code = huffman_decode_symbol(upng, reader, &codetree);
 		if (upng->error != UPNG_EOK) {
 			return;
 		}
 
-		if (code == 256) {
-			/* end code */
-			done = 1;
-		} else if (code <= 255) {
+		if (code <= 255) {
 			/* literal symbol */
-			if ((*pos) >= outsize) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
+			if (output->pos >= output->end && !grow_output(upng, output, 0)) {
 				return;
 			}
 
 			/* store output */
-			out[(*pos)++] = (unsigned char)(code);
+			output->window[output->pos++] = (unsigned char)(code);
 		} else if (code >= FIRST_LENGTH_CODE_INDEX && code <= LAST_LENGTH_CODE_INDEX) {	/*length code */
-			/* part 1: get length base */
-			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
-			unsigned codeD, distance, numextrabitsD;
-			unsigned long start, forward, backward, numextrabits;
-
-			/* part 2: get extra bits and add the value of that to length */
-			numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
+			unsigned long length, distance;
+			unsigned codeD;
 
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
-				return;
-			}
-			length += read_bits(bp, in, numextrabits);
+			/* get length base, and add the value of the extra bits to it */
+			length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX] + read_bits(reader, LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX]);
 
-			/*part 3: get distance code */
-			codeD = huffman_decode_symbol(upng, in, bp, &codetreeD, inlength);
+			/* get distance code */
+			codeD = huffman_decode_symbol(upng, reader, &codetreeD);
 			if (upng->error != UPNG_EOK) {
 				return;
 			}
@@ -520,115 +691,116 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 				return;
 			}
 
-			distance = DISTANCE_BASE[codeD];
+			distance = DISTANCE_BASE[codeD] + read_bits(reader, DISTANCE_EXTRA[codeD]);
 
-			/*part 4: get extra bits from distance */
-			numextrabitsD = DISTANCE_EXTRA[codeD];
-
-			/* error, bit pointer will jump past memory */
-			if (((*bp) >> 3) >= inlength) {
-				SET_ERROR(upng, UPNG_EMALFORMED);
+			/* error, the length goes past the end of the output */
+			if (output->pos + length >= output->end && !grow_output(upng, output, length)) {
 				return;
 			}
 
-			distance += read_bits(bp, in, numextrabitsD);
-
-			/*part 5: fill in all the out[n] values based on the length and dist */
-			start = (*pos);
-			backward = start - distance;
-
-			if ((*pos) + length >= outsize) {
+			/* error, the distance goes back before the start of the output; the window keeps the last 32KB */
+			if (distance > output->pos) {
 				SET_ERROR(upng, UPNG_EMALFORMED);
 				return;
 			}
 
-			for (forward = 0; forward < length; forward++) {
-				out[(*pos)++] = out[backward];
-				backward++;
+			copy_match(output->window, output->size, output->pos, distance, length);
+			output->pos += length;
+		} else if (code == 256) {
+			/* end code */
+			break;
+		} else {
+			/* length codes 286-287 are never used */
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
 
-				if (backward >= start) {
-					backward = start - distance;
-				}
-			}
+		/* error: end of input memory reached without endcode */
+		if (bits_overrun(reader)) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
 		}
 	}
+
+	if (bits_overrun(reader)) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
 }
 
-static void inflate_uncompressed(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength)
+static void inflate_uncompressed(upng_t* upng, inflate_output* output, bit_reader* reader)
 {
-	unsigned long p;
-	unsigned len, nlen, n;
+	unsigned long len, nlen;
 
 	/* go to first boundary of byte */
-	while (((*bp) & 0x7) != 0) {
-		(*bp)++;
-	}
-	p = (*bp) / 8;		/*byte position */
+	consume_bits(reader, reader->count & 7);
 
 	/* read len (2 bytes) and nlen (2 bytes) */
-	if (p >= inlength - 4) {
+	len = read_bits(reader, 16);
+	nlen = read_bits(reader, 16);
+	if (bits_overrun(reader)) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	len = in[p] + 256 * in[p + 1];
-	p += 2;
-	nlen = in[p] + 256 * in[p + 1];
-	p += 2;
-
 	/* check if 16-bit nlen is really the one's complement of len */
 	if (len + nlen != 65535) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	if ((*pos) + len >= outsize) {
+	if (output->total + output->pos + len >= output->limit) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return;
 	}
 
-	/* read the literal data: len bytes are now stored in the out buffer */
-	if (p + len > inlength) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
+	/* read the literal data: len bytes are now stored in the window, as much at a time as it has room for */
+	while (len > 0) {
+		unsigned long n;
 
-	for (n = 0; n < len; n++) {
-		out[(*pos)++] = in[p++];
-	}
+		if (output->pos >= output->end && !grow_output(upng, output, 0)) {
+			return;
+		}
+
+		n = output->size - output->pos;
+		if (n > len) {
+			n = len;
+		}
 
-	(*bp) = p * 8;
+		if (!read_bytes(reader, output->window + output->pos, n)) {
+			SET_ERROR(upng, UPNG_EMALFORMED);
+			return;
+		}
+		output->pos += n;
+		len -= n;
+	}
 }
 
 /*inflate the deflated data (cfr. deflate spec); return value is the error*/
-static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned long outsize, const unsigned char *in, unsigned long insize, unsigned long inpos)
+static upng_error uz_inflate_data(upng_t* upng, inflate_output* output, bit_reader* reader)
 {
-	unsigned long bp = 0;	/*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte) */
-	unsigned long pos = 0;	/*byte position in the out buffer */
-
 	unsigned done = 0;
 
 	while (done == 0) {
 		unsigned btype;
 
-		/* ensure next bit doesn't point past the end of the buffer */
-		if ((bp >> 3) >= insize) {
+		/* read block control bits */
+		done = read_bits(reader, 1);
+		btype = read_bits(reader, 2);
+
+		/* ensure the block header wasn't read past the end of the input */
+		if (bits_overrun(reader)) {
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			return upng->error;
 		}
 
-		/* read block control bits */
-		done = read_bit(&bp, &in[inpos]);
-		btype = read_bit(&bp, &in[inpos]) | (read_bit(&bp, &in[inpos]) << 1);
-
 		/* process control type appropriateyly */
 		if (btype == 3) {
 			SET_ERROR(upng, UPNG_EMALFORMED);
 			return upng->error;
 		} else if (btype == 0) {
-			inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize);	/*no compression */
+			inflate_uncompressed(upng, output, reader);	/*no compression */
 		} else {
-			inflate_huffman(upng, out, outsize, &in[inpos], &bp, &pos, insize, btype);	/*compression, btype 01 or 10 */
+			inflate_huffman(upng, output, reader, btype);	/*compression, btype 01 or 10 */
 		}
 
 		/* stop if an error has occured */
@@ -640,34 +812,47 @@ static upng_error uz_inflate_data(upng_t* upng, unsigned char* out, unsigned lon
 	return upng->error;
 }
 
-static upng_error uz_inflate(upng_t* upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long insize)
+static upng_error uz_inflate(upng_t* upng, inflate_output* output, bit_reader* reader)
 {
+	unsigned cmf, flg;
+
 	/* we require two bytes for the zlib data header */
-	if (insize < 2) {
+	cmf = read_bits(reader, 8);
+	flg = read_bits(reader, 8);
+	if (bits_overrun(reader)) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
-	/* 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way */
-	if ((in[0] * 256 + in[1]) % 31 != 0) {
+	/* 256 * cmf + flg must be a multiple of 31, the FCHECK value is supposed to be made that way */
+	if ((cmf * 256 + flg) % 31 != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec */
-	if ((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) {
+	if ((cmf & 15) != 8 || ((cmf >> 4) & 15) > 7) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
 	/* the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary." */
-	if (((in[1] >> 5) & 1) != 0) {
+	if (((flg >> 5) & 1) != 0) {
 		SET_ERROR(upng, UPNG_EMALFORMED);
 		return upng->error;
 	}
 
-	/* create output buffer */
-	uz_inflate_data(upng, out, outsize, in, insize, 2);
+	uz_inflate_data(upng, output, reader);
+
+	/* unfilter the scanlines still in the window */
+	if (upng->error == UPNG_EOK) {
+		flush_scanlines(upng, output);
+	}
+
+	/* error, the data ends before the last scanline */
+	if (upng->error == UPNG_EOK && output->y < output->h) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+	}
 
 	return upng->error;
 }
@@ -688,6 +873,110 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+#ifdef UPNG_SSE2
+/*
+   SSE2 versions of the filters. Up works on 16 bytes at a time. Sub, Average and Paeth depend on the
+   pixel to the left, so for 4 bytes per pixel (RGBA8, our textures) a whole pixel is done at once.
+   As in unfilter_scanline, recon and scanline may be the same memory; every byte is read before it is written.
+ */
+static __m128i load_pixel(const unsigned char* p)
+{
+	int value;
+	memcpy(&value, p, 4);
+	return _mm_cvtsi32_si128(value);
+}
+
+static void store_pixel(unsigned char* p, __m128i pixel)
+{
+	int value = _mm_cvtsi128_si32(pixel);
+	memcpy(p, &value, 4);
+}
+
+static void unfilter_up_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	unsigned long i;
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+		_mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+	}
+	for (; i < length; i++)
+		recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilter_sub4_sse2(unsigned char *recon, const unsigned char *scanline, unsigned long length)
+{
+	__m128i a = _mm_setzero_si128();	/*the previous pixel, in every lane */
+	unsigned long i;
+
+	/*running sum of the 4 pixels of a block (two shifted adds), plus the last pixel of the previous block */
+	for (i = 0; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi8(x, a);
+		_mm_storeu_si128((__m128i*)(recon + i), x);
+		a = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	for (; i < length; i += 4) {
+		a = _mm_add_epi8(load_pixel(scanline + i), a);
+		store_pixel(recon + i, a);
+	}
+}
+
+static void unfilter_average4_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	__m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	unsigned long i;
+
+	for (i = 0; i < length; i += 4) {
+		__m128i b = load_pixel(precon + i);
+		/*the rounded down average is the rounded up one, minus 1 where the sum is odd */
+		__m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(load_pixel(scanline + i), average);
+		store_pixel(recon + i, a);
+	}
+}
+
+static __m128i abs_epi16(__m128i v)
+{
+	return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void unfilter_paeth4_sse2(unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long length)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero;	/*left, above and upper left pixels, widened to 16 bits */
+	__m128i c = zero;
+	unsigned long i;
+
+	for (i = 0; i < length; i += 4) {
+		__m128i b = _mm_unpacklo_epi8(load_pixel(precon + i), zero);
+
+		/*with p = a + b - c: |p - a| = |b - c|, |p - b| = |a - c| and |p - c| = |(a - c) + (b - c)| */
+		__m128i pa = abs_epi16(_mm_sub_epi16(b, c));
+		__m128i pb = abs_epi16(_mm_sub_epi16(a, c));
+		__m128i pc = abs_epi16(_mm_add_epi16(_mm_sub_epi16(a, c), _mm_sub_epi16(b, c)));
+		__m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+		/*same ties as paeth_predictor: a first, then b */
+		__m128i predictor = select_si128(_mm_cmpeq_epi16(pb, smallest), b, c);
+		predictor = select_si128(_mm_cmpeq_epi16(pa, smallest), a, predictor);
+
+		a = _mm_add_epi8(load_pixel(scanline + i), _mm_packus_epi16(predictor, predictor));
+		store_pixel(recon + i, a);
+		a = _mm_unpacklo_epi8(a, zero);
+		c = b;
+	}
+}
+#endif
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned char *scanline, const unsigned char *precon, unsigned long bytewidth, unsigned char filterType, unsigned long length)
 {
 	/*
@@ -705,12 +994,24 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 			recon[i] = scanline[i];
 		break;
 	case 1:
+#ifdef UPNG_SSE2
+		if (bytewidth == 4) {
+			unfilter_sub4_sse2(recon, scanline, length);
+			break;
+		}
+#endif
 		for (i = 0; i < bytewidth; i++)
 			recon[i] = scanline[i];
 		for (i = bytewidth; i < length; i++)
 			recon[i] = scanline[i] + recon[i - bytewidth];
 		break;
 	case 2:
+#ifdef UPNG_SSE2
+		if (precon) {
+			unfilter_up_sse2(recon, scanline, precon, length);
+			break;
+		}
+#endif
 		if (precon)
 			for (i = 0; i < length; i++)
 				recon[i] = scanline[i] + precon[i];
@@ -719,6 +1020,12 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 				recon[i] = scanline[i];
 		break;
 	case 3:
+#ifdef UPNG_SSE2
+		if (precon && bytewidth == 4) {
+			unfilter_average4_sse2(recon, scanline, precon, length);
+			break;
+		}
+#endif
 		if (precon) {
 			for (i = 0; i < bytewidth; i++)
 				recon[i] = scanline[i] + precon[i] / 2;
@@ -732,6 +1039,12 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 		}
 		break;
 	case 4:
+#ifdef UPNG_SSE2
+		if (precon && bytewidth == 4) {
+			unfilter_paeth4_sse2(recon, scanline, precon, length);
+			break;
+		}
+#endif
 		if (precon) {
 			for (i = 0; i < bytewidth; i++)
 				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(0, precon[i], 0));
@@ -750,36 +1063,6 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon, const unsigned
 	}
 }
 
-static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in, unsigned w, unsigned h, unsigned bpp)
-{
-	/*
-	   For PNG filter method 0
-	   this function unfilters a single image (e.g. without interlacing this is called once, with Adam7 it's called 7 times)
-	   out must have enough bytes allocated already, in must have the scanlines + 1 filtertype byte per scanline
-	   w and h are image dimensions or dimensions of reduced image, bpp is bpp per pixel
-	   in and out are allowed to be the same memory address!
-	 */
-
-	unsigned y;
-	unsigned char *prevline = 0;
-
-	unsigned long bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
-	unsigned long linebytes = (w * bpp + 7) / 8;
-
-	for (y = 0; y < h; y++) {
-		unsigned long outindex = linebytes * y;
-		unsigned long inindex = (1 + linebytes) * y;	/*the extra filterbyte added to each row */
-		unsigned char filterType = in[inindex];
-
-		unfilter_scanline(upng, &out[outindex], &in[inindex + 1], prevline, bytewidth, filterType, linebytes);
-		if (upng->error != UPNG_EOK) {
-			return;
-		}
-
-		prevline = &out[outindex];
-	}
-}
-
 static void remove_padding_bits(unsigned char *out, const unsigned char *in, unsigned long olinebits, unsigned long ilinebits, unsigned h)
 {
 	/*
@@ -807,29 +1090,6 @@ static void remove_padding_bits(unsigned char *out, const unsigned char *in, uns
 	}
 }
 
-/*out must be buffer big enough to contain full image, and in must contain the full decompressed data from the IDAT chunks*/
-static void post_process_scanlines(upng_t* upng, unsigned char *out, unsigned char *in, const upng_t* info_png)
-{
-	unsigned bpp = upng_get_bpp(info_png);
-	unsigned w = info_png->width;
-	unsigned h = info_png->height;
-
-	if (bpp == 0) {
-		SET_ERROR(upng, UPNG_EMALFORMED);
-		return;
-	}
-
-	if (bpp < 8 && w * bpp != ((w * bpp + 7) / 8) * 8) {
-		unfilter(upng, in, in, w, h, bpp);
-		if (upng->error != UPNG_EOK) {
-			return;
-		}
-		remove_padding_bits(out, in, w * bpp, ((w * bpp + 7) / 8) * 8, h);
-	} else {
-		unfilter(upng, out, in, w, h, bpp);	/*we can immediatly filter into the out buffer, no other steps needed */
-	}
-}
-
 static upng_format determine_format(upng_t* upng) {
 	switch (upng->color_type) {
 	case UPNG_LUM:
@@ -960,15 +1220,36 @@ upng_error upng_header(upng_t* upng)
 	return upng->error;
 }
 
-/*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
-upng_error upng_decode(upng_t* upng)
+static unsigned long decoded_size(const upng_t* upng)
+{
+	return (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
+}
+
+static void upng_free_buffer(upng_t* upng)
+{
+	if (upng->buffer_owning != 0) {
+		free(upng->buffer);
+	}
+
+	upng->buffer = NULL;
+	upng->size = 0;
+	upng->buffer_owning = 0;
+}
+
+/*read a PNG into a buffer of the caller, the result will be in the same color type as the PNG (hence "generic").
+  The buffer must hold at least (width * height * bpp + 7) / 8 bytes and stays owned by the caller. The IDAT data
+  is inflated straight from the source into a window in the scratch memory, and the scanlines are unfiltered
+  into the buffer as they come, so the scratch memory holds a few scanlines rather than the whole image. It only
+  grows, so reusing it for a series of images leaves a single allocation.*/
+upng_error upng_decode_into(upng_t* upng, unsigned char* buffer, unsigned long size, upng_scratch* scratch)
 {
 	const unsigned char *chunk;
-	unsigned char* compressed;
-	unsigned char* inflated;
-	unsigned long compressed_size = 0, compressed_index = 0;
-	unsigned long inflated_size;
-	upng_error error;
+	const unsigned char *end;
+	bit_reader reader;
+	inflate_output output;
+	unsigned long window_size, scratch_size;
+	unsigned bpp;
+	int padded;
 
 	/* if we have an error state, bail now */
 	if (upng->error != UPNG_EOK) {
@@ -987,20 +1268,27 @@ upng_error upng_decode(upng_t* upng)
 	}
 
 	/* release old result, if any */
-	if (upng->buffer != 0) {
-		free(upng->buffer);
-		upng->buffer = 0;
-		upng->size = 0;
+	upng_free_buffer(upng);
+
+	if (buffer == NULL || size < decoded_size(upng) || scratch == NULL) {
+		SET_ERROR(upng, UPNG_EPARAM);
+		return upng->error;
+	}
+
+	bpp = upng_get_bpp(upng);
+	if (bpp == 0) {
+		SET_ERROR(upng, UPNG_EMALFORMED);
+		return upng->error;
 	}
 
 	/* first byte of the first chunk after the header */
 	chunk = upng->source.buffer + 33;
+	end = upng->source.buffer + upng->source.size;
 
-	/* scan through the chunks, finding the size of all IDAT chunks, and also
-	 * verify general well-formed-ness */
-	while (chunk < upng->source.buffer + upng->source.size) {
+	/* scan through the chunks, verifying general well-formed-ness before the
+	 * bit reader walks through the IDAT chunks */
+	while (chunk < end) {
 		unsigned long length;
-		const unsigned char *data;	/*the data in the chunk */
 
 		/* make sure chunk header is not larger than the total compressed */
 		if ((unsigned long)(chunk - upng->source.buffer + 12) > upng->source.size) {
@@ -1021,15 +1309,10 @@ upng_error upng_decode(upng_t* upng)
 			return upng->error;
 		}
 
-		/* get pointer to payload */
-		data = chunk + 8;
-
 		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			compressed_size += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
+		if (upng_chunk_type(chunk) == CHUNK_IEND) {
 			break;
-		} else if (upng_chunk_critical(chunk)) {
+		} else if (upng_chunk_type(chunk) != CHUNK_IDAT && upng_chunk_critical(chunk)) {
 			SET_ERROR(upng, UPNG_EUNSUPPORTED);
 			return upng->error;
 		}
@@ -1037,82 +1320,94 @@ upng_error upng_decode(upng_t* upng)
 		chunk += upng_chunk_length(chunk) + 12;
 	}
 
-	/* allocate enough space for the (compressed and filtered) image data */
-	compressed = (unsigned char*)malloc(compressed_size);
-	if (compressed == NULL) {
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
+	output.linebytes = (upng->width * bpp + 7) / 8;
+	output.bytewidth = (bpp + 7) / 8;	/*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise */
+	output.h = upng->height;
+
+	/* scanlines padded to whole bytes are unfiltered into the scratch memory, after the window, and packed into the buffer at the end */
+	padded = bpp < 8 && upng->width * bpp != output.linebytes * 8;
+
+	/* make room for the window and the padded scanlines */
+	window_size = INFLATE_WINDOW_SIZE + INFLATE_FLUSH_SIZE + INFLATE_MATCH_ROOM + output.linebytes + 1;
+	scratch_size = window_size + (padded ? output.linebytes * output.h : 0);
+	if (scratch->size < scratch_size) {
+		free(scratch->buffer);
+		scratch->buffer = (unsigned char*)malloc(scratch_size);
+		scratch->size = scratch->buffer != NULL ? scratch_size : 0;
+		if (scratch->buffer == NULL) {
+			SET_ERROR(upng, UPNG_ENOMEM);
+			return upng->error;
+		}
 	}
 
-	/* scan through the chunks again, this time copying the values into
-	 * our compressed buffer.  there's no reason to validate anything a second time. */
-	chunk = upng->source.buffer + 33;
-	while (chunk < upng->source.buffer + upng->source.size) {
-		unsigned long length;
-		const unsigned char *data;	/*the data in the chunk */
+	output.window = scratch->buffer;
+	output.size = window_size;
+	output.pos = 0;
+	output.total = 0;
+	output.limit = ((upng->width * (upng->height * bpp + 7)) / 8) + upng->height;	/*size of the inflated (but still filtered) data */
+	output.row = 0;
+	output.image = padded ? scratch->buffer + window_size : buffer;
+	output.y = 0;
+	flush_scanlines(upng, &output);
+
+	/* decompress and unfilter the image data */
+	bit_reader_init(&reader, upng->source.buffer + 33, end);
+	if (uz_inflate(upng, &output, &reader) == UPNG_EOK && padded) {
+		remove_padding_bits(buffer, output.image, upng->width * bpp, output.linebytes * 8, upng->height);
+	}
 
-		length = upng_chunk_length(chunk);
-		data = chunk + 8;
+	if (upng->error == UPNG_EOK) {
+		upng->buffer = buffer;
+		upng->size = decoded_size(upng);
+		upng->state = UPNG_DECODED;
+	}
 
-		/* parse chunks */
-		if (upng_chunk_type(chunk) == CHUNK_IDAT) {
-			memcpy(compressed + compressed_index, data, length);
-			compressed_index += length;
-		} else if (upng_chunk_type(chunk) == CHUNK_IEND) {
-			break;
-		}
+	/* we are done with our input buffer; free it if we own it */
+	upng_free_source(upng);
 
-		chunk += upng_chunk_length(chunk) + 12;
-	}
+	return upng->error;
+}
 
-	/* allocate space to store inflated (but still filtered) data */
-	inflated_size = ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) + upng->height;
-	inflated = (unsigned char*)malloc(inflated_size);
-	if (inflated == NULL) {
-		free(compressed);
-		SET_ERROR(upng, UPNG_ENOMEM);
-		return upng->error;
-	}
+/*read a PNG into a buffer owned by the upng_t, see upng_decode_into*/
+upng_error upng_decode(upng_t* upng)
+{
+	upng_scratch scratch = { NULL, 0 };
+	unsigned char* buffer;
+	unsigned long size;
 
-	/* decompress image data */
-	error = uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
-	if (error != UPNG_EOK) {
-		free(compressed);
-		free(inflated);
+	/* parse the main header, if necessary, to know the size of the image */
+	upng_header(upng);
+	if (upng->error != UPNG_EOK || upng->state != UPNG_HEADER) {
 		return upng->error;
 	}
 
-	/* free the compressed compressed data */
-	free(compressed);
-
 	/* allocate final image buffer */
-	upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
-	upng->buffer = (unsigned char*)malloc(upng->size);
-	if (upng->buffer == NULL) {
-		free(inflated);
-		upng->size = 0;
+	size = decoded_size(upng);
+	buffer = (unsigned char*)malloc(size);
+	if (buffer == NULL) {
 		SET_ERROR(upng, UPNG_ENOMEM);
 		return upng->error;
 	}
 
-	/* unfilter scanlines */
-	post_process_scanlines(upng, upng->buffer, inflated, upng);
-	free(inflated);
+	upng_decode_into(upng, buffer, size, &scratch);
+	upng_free_scratch(&scratch);
 
 	if (upng->error != UPNG_EOK) {
-		free(upng->buffer);
-		upng->buffer = NULL;
-		upng->size = 0;
+		free(buffer);
 	} else {
-		upng->state = UPNG_DECODED;
+		upng->buffer_owning = 1;
 	}
 
-	/* we are done with our input buffer; free it if we own it */
-	upng_free_source(upng);
-
 	return upng->error;
 }
 
+void upng_free_scratch(upng_scratch* scratch)
+{
+	free(scratch->buffer);
+	scratch->buffer = NULL;
+	scratch->size = 0;
+}
+
 static upng_t* upng_new(void)
 {
 	upng_t* upng;
@@ -1124,6 +1419,7 @@ static upng_t* upng_new(void)
 
 	upng->buffer = NULL;
 	upng->size = 0;
+	upng->buffer_owning = 0;
 
 	upng->width = upng->height = 0;
 
@@ -1204,10 +1500,8 @@ upng_t* upng_new_from_file(const char *filename)
 
 void upng_free(upng_t* upng)
 {
-	/* deallocate image buffer */
-	if (upng->buffer != NULL) {
-		free(upng->buffer);
-	}
+	/* deallocate image buffer, if necessary */
+	upng_free_buffer(upng);
 
 	/* deallocate source buffer, if necessary */
 	upng_free_source(upng);
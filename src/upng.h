@@ -57,12 +57,20 @@ typedef enum upng_format {
 
 typedef struct upng_t upng_t;
 
+/* working memory of upng_decode_into, reusable by the following decodes (one at a time) */
+typedef struct upng_scratch {
+	unsigned char*	buffer;
+	unsigned long	size;
+} upng_scratch;
+
 upng_t*		upng_new_from_bytes	(const unsigned char* buffer, unsigned long size);
 upng_t*		upng_new_from_file	(const char* path);
 void		upng_free			(upng_t* upng);
 
 upng_error	upng_header			(upng_t* upng);
 upng_error	upng_decode			(upng_t* upng);
+upng_error	upng_decode_into	(upng_t* upng, unsigned char* buffer, unsigned long size, upng_scratch* scratch);
+void		upng_free_scratch	(upng_scratch* scratch);
 
 upng_error	upng_get_error		(const upng_t* upng);
 unsigned	upng_get_error_line	(const upng_t* upng);
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vertex_cache.h"
+#include "array.h"
+
+static int* face_index(face_t* face, int corner) {
+	return corner == 0 ? &face->a : (corner == 1 ? &face->b : &face->c);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Average cache miss ratio: vertices transformed per face with a FIFO cache of
+// VERTEX_CACHE_SIZE entries (3.0 means no reuse at all, 0.5 is the optimum
+// for large regular meshes)
+///////////////////////////////////////////////////////////////////////////////
+float get_average_cache_miss_ratio(face_t* faces, int num_faces, int num_vertices) {
+	if (num_faces == 0) {
+		return 0;
+	}
+
+	// A vertex is in the cache while fewer than VERTEX_CACHE_SIZE misses happened since it was loaded
+	int* cache_time = (int*)malloc(sizeof(int) * num_vertices);
+	for (int i = 0; i < num_vertices; i++) {
+		cache_time[i] = -VERTEX_CACHE_SIZE - 1;
+	}
+
+	int misses = 0;
+	for (int i = 0; i < num_faces; i++) {
+		for (int k = 0; k < 3; k++) {
+			int v = *face_index(&faces[i], k);
+			if (misses - cache_time[v] > VERTEX_CACHE_SIZE) {
+				cache_time[v] = misses;
+				misses++;
+			}
+		}
+	}
+
+	free(cache_time);
+	return (float)misses / num_faces;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reorder faces in place with Tipsify (Sander, Nehab & Barczak 2007): faces
+// are emitted as fans around a vertex, and the next fan vertex is the
+// neighbour that is still in the cache and has the fewest faces left.
+///////////////////////////////////////////////////////////////////////////////
+void optimize_vertex_cache(face_t* faces, int num_faces, int num_vertices) {
+	if (num_faces == 0) {
+		return;
+	}
+
+	// Vertex to face adjacency, and the number of faces left to emit per vertex
+	int* live_faces = (int*)calloc(num_vertices, sizeof(int));
+	int* adjacency_offsets = (int*)calloc(num_vertices + 1, sizeof(int));
+	int* adjacency = (int*)malloc(sizeof(int) * num_faces * 3);
+	for (int i = 0; i < num_faces; i++) {
+		for (int k = 0; k < 3; k++) {
+			adjacency_offsets[*face_index(&faces[i], k) + 1]++;
+		}
+	}
+	for (int i = 0; i < num_vertices; i++) {
+		live_faces[i] = adjacency_offsets[i + 1];
+		adjacency_offsets[i + 1] += adjacency_offsets[i];
+	}
+	int* adjacency_fill = (int*)malloc(sizeof(int) * num_vertices);
+	memcpy(adjacency_fill, adjacency_offsets, sizeof(int) * num_vertices);
+	for (int i = 0; i < num_faces; i++) {
+		for (int k = 0; k < 3; k++) {
+			adjacency[adjacency_fill[*face_index(&faces[i], k)]++] = i;
+		}
+	}
+	free(adjacency_fill);
+
+	int* cache_time = (int*)calloc(num_vertices, sizeof(int));
+	bool* emitted = (bool*)calloc(num_faces, sizeof(bool));
+	int* dead_end = (int*)malloc(sizeof(int) * num_faces * 3);
+	int* candidates = (int*)malloc(sizeof(int) * num_faces * 3);
+	face_t* output = (face_t*)malloc(sizeof(face_t) * num_faces);
+	int num_output = 0;
+	int num_dead_end = 0;
+	int time = VERTEX_CACHE_SIZE + 1;
+	int cursor = 0;
+
+	int fan_vertex = faces[0].a;
+	while (fan_vertex >= 0) {
+		int num_candidates = 0;
+
+		// Emit every remaining face around the fan vertex
+		for (int i = adjacency_offsets[fan_vertex]; i < adjacency_offsets[fan_vertex + 1]; i++) {
+			int face = adjacency[i];
+			if (emitted[face]) {
+				continue;
+			}
+			emitted[face] = true;
+			output[num_output++] = faces[face];
+
+			for (int k = 0; k < 3; k++) {
+				int v = *face_index(&faces[face], k);
+				dead_end[num_dead_end++] = v;
+				candidates[num_candidates++] = v;
+				live_faces[v]--;
+				if (time - cache_time[v] > VERTEX_CACHE_SIZE) {
+					cache_time[v] = time++;
+				}
+			}
+		}
+
+		// Prefer the candidate that stays longest in the cache after its fan is emitted
+		int next_vertex = -1;
+		int best_priority = -1;
+		for (int i = 0; i < num_candidates; i++) {
+			int v = candidates[i];
+			if (live_faces[v] <= 0) {
+				continue;
+			}
+			int priority = 0;
+			if (time - cache_time[v] + 2 * live_faces[v] <= VERTEX_CACHE_SIZE) {
+				priority = time - cache_time[v];
+			}
+			if (priority > best_priority) {
+				best_priority = priority;
+				next_vertex = v;
+			}
+		}
+
+		// Dead end: go back to a recently used vertex, or to the next one in input order
+		while (next_vertex < 0 && num_dead_end > 0) {
+			int v = dead_end[--num_dead_end];
+			if (live_faces[v] > 0) {
+				next_vertex = v;
+			}
+		}
+		while (next_vertex < 0 && cursor < num_vertices) {
+			if (live_faces[cursor] > 0) {
+				next_vertex = cursor;
+			}
+			cursor++;
+		}
+
+		fan_vertex = next_vertex;
+	}
+
+	memcpy(faces, output, sizeof(face_t) * num_faces);
+
+	free(output);
+	free(candidates);
+	free(dead_end);
+	free(emitted);
+	free(cache_time);
+	free(adjacency);
+	free(adjacency_offsets);
+	free(live_faces);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Renumber the vertices in the order the faces first use them, so the
+// transform and assembly stages walk the vertex array front to back. The
+// coarsest level goes first and every finer level appends the vertices it
+// adds, so each level only uses a prefix of the array (the simplified levels
+// keep a subset of the vertices of the level they come from). Vertices that
+// no face uses are moved to the end.
+///////////////////////////////////////////////////////////////////////////////
+void optimize_vertex_fetch(mesh_t* mesh) {
+	int num_vertices = array_length(mesh->vertices);
+
+	int* remap = (int*)malloc(sizeof(int) * (num_vertices + 1));
+	for (int i = 0; i < num_vertices; i++) {
+		remap[i] = -1;
+	}
+
+	int next_index = 0;
+	for (int l = mesh->num_lods - 1; l >= 0; l--) {
+		face_t* faces = mesh->lods[l].faces;
+		for (int i = 0; i < array_length(faces); i++) {
+			for (int k = 0; k < 3; k++) {
+				int v = *face_index(&faces[i], k);
+				if (remap[v] < 0) {
+					remap[v] = next_index++;
+				}
+			}
+		}
+		mesh->lods[l].num_vertices = next_index;
+	}
+	for (int i = 0; i < num_vertices; i++) {
+		if (remap[i] < 0) {
+			remap[i] = next_index++;
+		}
+	}
+
+	vec3_t* original_vertices = (vec3_t*)malloc(sizeof(vec3_t) * (num_vertices + 1));
+	tex2_t* original_uvs = (tex2_t*)malloc(sizeof(tex2_t) * (num_vertices + 1));
+	memcpy(original_vertices, mesh->vertices, sizeof(vec3_t) * num_vertices);
+	memcpy(original_uvs, mesh->uvs, sizeof(tex2_t) * num_vertices);
+	for (int i = 0; i < num_vertices; i++) {
+		mesh->vertices[remap[i]] = original_vertices[i];
+		mesh->uvs[remap[i]] = original_uvs[i];
+	}
+
+	// Every level of detail indexes the same vertex array (level 0 is mesh->faces)
+	for (int l = 0; l < mesh->num_lods; l++) {
+		face_t* faces = mesh->lods[l].faces;
+		for (int i = 0; i < array_length(faces); i++) {
+			faces[i].a = remap[faces[i].a];
+			faces[i].b = remap[faces[i].b];
+			faces[i].c = remap[faces[i].c];
+		}
+	}
+
+	free(original_uvs);
+	free(original_vertices);
+	free(remap);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reorder the faces of every meshlet for vertex reuse (meshlets keep their
+// face ranges), then renumber the vertices for sequential access
+///////////////////////////////////////////////////////////////////////////////
+void optimize_mesh(mesh_t* mesh) {
+	int num_vertices = array_length(mesh->vertices);
+
+	// Meshlets are small, so they are optimized on a compact local numbering
+	int* local_index = (int*)malloc(sizeof(int) * num_vertices);
+	for (int i = 0; i < num_vertices; i++) {
+		local_index[i] = -1;
+	}
+
+	for (int l = 0; l < mesh->num_lods; l++) {
+		mesh_lod_t* lod = &mesh->lods[l];
+		for (int m = 0; m < array_length(lod->meshlets); m++) {
+			face_t* faces = &lod->faces[lod->meshlets[m].first_face];
+			int num_faces = lod->meshlets[m].num_faces;
+
+			int global_index[MESHLET_MAX_FACES * 3];
+			int num_local = 0;
+			for (int i = 0; i < num_faces; i++) {
+				for (int k = 0; k < 3; k++) {
+					int* v = face_index(&faces[i], k);
+					if (local_index[*v] < 0) {
+						local_index[*v] = num_local;
+						global_index[num_local++] = *v;
+					}
+					*v = local_index[*v];
+				}
+			}
+
+			optimize_vertex_cache(faces, num_faces, num_local);
+
+			for (int i = 0; i < num_faces; i++) {
+				for (int k = 0; k < 3; k++) {
+					int* v = face_index(&faces[i], k);
+					*v = global_index[*v];
+				}
+			}
+			for (int i = 0; i < num_local; i++) {
+				local_index[global_index[i]] = -1;
+			}
+		}
+	}
+
+	free(local_index);
+
+	optimize_vertex_fetch(mesh);
+}
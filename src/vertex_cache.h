@@ -0,0 +1,14 @@
+#ifndef VERTEX_CACHE_H
+#define VERTEX_CACHE_H
+
+#include "mesh.h"
+
+// Size of the simulated post-transform FIFO cache used to order the faces
+#define VERTEX_CACHE_SIZE 16
+
+float get_average_cache_miss_ratio(face_t* faces, int num_faces, int num_vertices);
+void optimize_vertex_cache(face_t* faces, int num_faces, int num_vertices);
+void optimize_vertex_fetch(mesh_t* mesh);
+void optimize_mesh(mesh_t* mesh);
+
+#endif